@@ -0,0 +1,200 @@
+/* See LICENSE file for copyright and license details. */
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include "match.h"
+#include "search.h"
+
+#define BENCH
+#include "config.h"
+
+/* macros */
+#define LENGTH(X)               (sizeof X / sizeof X[0])
+#define MAX(a, b)               ((a) > (b) ? (a) : (b))
+
+/* forward declarations */
+static void bench(int fd);
+static int gencorpus(unsigned int n);
+static double now(void);
+static int latencycmp(const void *a, const void *b);
+static void percentiles(double *v, unsigned int n);
+static void session(const char *query, double *type, unsigned int *ntype,
+                    double *back, unsigned int *nback);
+
+/* variables */
+static const char *queries[] = {	/* typed key by key, then erased */
+	"gcc", "dmenu", "usr/bin/py", "conf xorg", "Lib font.so", "firefox",
+};
+static const struct {
+	const char *name;
+	Bool foldcase, xmms;
+} modes[] = {
+	{ "plain", False, False },
+	{ "-i",    True,  False },
+	{ "-xs",   False, True },
+};
+static const unsigned int sizes[] = { 10000, 100000, 1000000, 5000000 };
+
+/* Reads the corpus fd holds in each mode as dmenu reads stdin, then types
+ * and erases the queries, timing every keystroke. */
+void
+bench(int fd) {
+	double t, *type, *back;
+	unsigned int m, k, ntype, nback, keys = 0;
+
+	for(k = 0; k < LENGTH(queries); k++)
+		keys += strlen(queries[k]);
+	if(!(type = malloc(keys * sizeof(double))) || !(back = malloc(keys * sizeof(double))))
+		eprint("fatal: could not malloc() %u bytes\n", keys * sizeof(double));
+	for(m = 0; m < LENGTH(modes); m++) {
+		freeitems();
+		foldcase = modes[m].foldcase;
+		xmms = modes[m].xmms;
+		lseek(fd, 0, SEEK_SET);
+		dup2(fd, STDIN_FILENO);
+		t = now();
+		readstdin();
+		t = now() - t;
+		if(!m) {
+			printf("%u lines, %s folding\n", nitems, searchimpl());
+			printf("%-6s %8s %5s %9s %9s %9s %9s  %9s %9s %9s %9s\n", "mode", "read ms", "keys",
+			       "type p50", "p90", "p99", "max", "back p50", "p90", "p99", "max");
+		}
+		ntype = nback = 0;
+		for(k = 0; k < LENGTH(queries); k++)
+			session(queries[k], type, &ntype, back, &nback);
+		printf("%-6s %8.1f %5u", modes[m].name, t / 1e6, ntype);
+		percentiles(type, ntype);
+		putchar(' ');
+		percentiles(back, nback);
+		putchar('\n');
+	}
+	free(type);
+	free(back);
+	freeitems();
+	foldcase = xmms = False;
+}
+
+/* writes n lines of paths and command names to an unlinked file */
+int
+gencorpus(unsigned int n) {
+	static const char *dirs[] = {
+		"/usr/bin/", "/usr/lib/x86_64-linux-gnu/", "/usr/share/doc/",
+		"/home/user/src/project/", "/etc/X11/xorg.conf.d/", "/opt/Local/Bin/",
+	};
+	static const char *parts[] = {
+		"gcc", "Xorg", "python3", "lib", "conf", "git", "dmenu", "firefox",
+		"Make", "util", "font", "config", "-", "_", ".so", ".1", "x86", "Run",
+	};
+	char tmp[] = "/tmp/dmenu-bench.XXXXXX";
+	unsigned int i, j, k;
+	FILE *f;
+	int fd;
+
+	if((fd = mkstemp(tmp)) == -1 || !(f = fdopen(dup(fd), "w")))
+		eprint("bench: cannot create '%s'\n", tmp);
+	unlink(tmp);
+	srand(1);
+	for(i = 0; i < n; i++) {
+		/* every other line is a bare command name like dmenu_path prints */
+		if(i % 2)
+			fputs(dirs[rand() % LENGTH(dirs)], f);
+		for(j = 0, k = 1 + rand() % 4; j < k; j++)
+			fputs(parts[rand() % LENGTH(parts)], f);
+		putc('\n', f);
+	}
+	if(fclose(f) == EOF)
+		eprint("bench: cannot write '%s'\n", tmp);
+	return fd;
+}
+
+int
+latencycmp(const void *a, const void *b) {
+	double da = *(double *)a, db = *(double *)b;
+
+	return da < db ? -1 : da > db;
+}
+
+double
+now(void) {
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+/* prints p50, p90, p99 and max of the n latencies in v, in microseconds */
+void
+percentiles(double *v, unsigned int n) {
+	qsort(v, n, sizeof(double), latencycmp);
+	printf(" %9.1f %9.1f %9.1f %9.1f", v[n / 2] / 1e3, v[n * 9 / 10] / 1e3,
+	       v[n * 99 / 100] / 1e3, v[n - 1] / 1e3);
+}
+
+/* types query from an empty pattern on, then erases it again */
+void
+session(const char *query, double *type, unsigned int *ntype, double *back, unsigned int *nback) {
+	char text[PATTERNSIZE] = "";
+	unsigned int len, n = strlen(query);
+	double t;
+
+	while(nresults)
+		popresult();
+	filter(text);
+	for(len = 1; len <= n; len++) {
+		memcpy(text, query, len);
+		text[len] = 0;
+		t = now();
+		filter(text);
+		type[(*ntype)++] = now() - t;
+	}
+	while(len-- > 1) {
+		text[len - 1] = 0;
+		t = now();
+		filter(text);
+		back[(*nback)++] = now() - t;
+	}
+}
+
+int
+main(int argc, char *argv[]) {
+	unsigned int i, n = 0;
+	char *file = NULL;
+	int fd, j;
+
+	for(i = 1; i < argc; i++)
+		if(!strcmp(argv[i], "-n") && i + 1 < argc)
+			n = atoi(argv[++i]);
+		else if(!strcmp(argv[i], "-j") && i + 1 < argc) {
+			j = atoi(argv[++i]);
+			matchthreads = MAX(j, 1);
+		}
+		else if(argv[i][0] != '-' && !file)
+			file = argv[i];
+		else
+			eprint("usage: bench [-n <lines>] [-j <threads>] [file]\n");
+	initsearch();
+	if(!(tokens = malloc(maxtokens * sizeof(char *))))
+		eprint("fatal: could not malloc() %u bytes\n", maxtokens * sizeof(char *));
+	if(file) {
+		if((fd = open(file, O_RDONLY)) == -1)
+			eprint("bench: cannot open '%s'\n", file);
+		bench(fd);
+		close(fd);
+	}
+	else
+		for(i = 0; i < (n ? 1 : LENGTH(sizes)); i++) {
+			if(i)
+				putchar('\n');
+			fd = gencorpus(n ? n : sizes[i]);
+			bench(fd);
+			close(fd);
+		}
+	cleanupmatch();
+	free(tokens);
+	return 0;
+}
@@ -0,0 +1,30 @@
+/* See LICENSE file for copyright and license details. */
+
+/* Binary item cache, written by dmenu_path and mapped by dmenu -cf: a
+ * CacheHeader, n offsets into the blob, the blob of NUL terminated items
+ * and, with CACHEFOLDED, the same blob once more in lowercase. dmenu_path
+ * appends, 8 byte aligned, what it needs to rescan only changed PATH
+ * directories: ndirs CacheDirs, for each the offsets of its items in the
+ * blob and the directory names. Numbers are in host byte order, a foreign
+ * cache fails the magic check. */
+#define CACHEMAGIC              0x32434d44	/* "DMC2" */
+#define CACHEFOLDED             1
+#define CACHEALIGN(x)           (((x) + 7) & ~(uint64_t)7)
+
+typedef struct {
+	uint32_t magic;
+	uint32_t flags;
+	uint32_t n;		/* items */
+	uint32_t size;		/* bytes of the blob */
+	uint32_t ndirs;		/* directories the items were found in */
+	uint32_t nentries;	/* items of all directories */
+	uint32_t pathsize;	/* bytes of the directory names */
+	uint32_t pad;
+} CacheHeader;
+
+typedef struct {
+	int64_t sec, nsec;	/* mtime when it was read */
+	uint32_t path;		/* offset of its name */
+	uint32_t first, n;	/* its entries */
+	uint32_t pad;
+} CacheDir;
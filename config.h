@@ -1,6 +1,7 @@
 /* See LICENSE file for copyright and license details. */
 
-/* appearance */
+/* appearance, bench has no use for it */
+#ifndef BENCH
 static const char *font        = "-*-terminus-medium-r-normal-*-18-*-*-*-*-*-*-*";
 static const char *normbgcolor = "#000000";
 static const char *normfgcolor = "#00FF00";
@@ -9,4 +10,8 @@ static const char *selfgcolor  = "#000000";
 static const char *lastbgcolor = "#008800";
 static const char *lastfgcolor = "#00FF00";
 static unsigned int spaceitem  = 35; /* px between menu items */
-static unsigned int maxtokens  = 16; /* max. tokens for pattern matching */
+#endif
+
+/* matching */
+unsigned int maxtokens  = 16; /* max. tokens for pattern matching */
+unsigned int matchthreads = 1; /* threads filtering large menus */
@@ -21,7 +21,7 @@ XFTFLAGS = -DXFT
 
 # includes and libs
 INCS = -I. -I/usr/include -I${X11INC} ${XFTINCS}
-LIBS = -L/usr/lib -lc -L${X11LIB} -lX11 ${XINERAMALIBS} ${XFTLIBS}
+LIBS = -L/usr/lib -lc -L${X11LIB} -lX11 ${XINERAMALIBS} ${XFTLIBS} -lpthread
 
 # flags
 CPPFLAGS = -D_BSD_SOURCE -DVERSION=\"${VERSION}\" ${XINERAMAFLAGS} ${XFTFLAGS}
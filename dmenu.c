@@ -1,12 +1,20 @@
 /* See LICENSE file for copyright and license details. */
 #include <ctype.h>
+#include <errno.h>
 #include <locale.h>
-#include <stdarg.h>
+#include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <strings.h>
 #include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <time.h>
 #include <X11/keysym.h>
 #include <X11/Xlib.h>
 #include <X11/Xutil.h>
@@ -16,15 +24,22 @@
 #ifdef XINERAMA
 #include <X11/extensions/Xinerama.h>
 #endif
+#include "match.h"
+#include "search.h"
 
 /* macros */
 #define CLEANMASK(mask)         (mask & ~(numlockmask | LockMask))
 #define INRECT(X,Y,RX,RY,RW,RH) ((X) >= (RX) && (X) < (RX) + (RW) && (Y) >= (RY) && (Y) < (RY) + (RH))
 #define MIN(a, b)               ((a) < (b) ? (a) : (b))
-#define HIST_SIZE 20
+#define MAX(a, b)               ((a) > (b) ? (a) : (b))
+#define LENGTH(X)               (sizeof X / sizeof X[0])
+#define HIT(k)                  (results[nresults - 1].items[k])	/* id of the kth match */
+#define ADVANCES 0x10000	/* codepoints with cached glyph widths */
 
 /* enums */
 enum { ColFG, ColBG, ColLast };
+enum { StatHistory, StatInput, StatSetup, StatGrab, StatMatch, StatDraw,
+       StatKey, StatKeyMatch, StatKeyDraw, StatLast };
 
 typedef struct {
     unsigned long x[ColLast];
@@ -50,6 +65,7 @@ typedef struct {
 		int ascent;
 		int descent;
 		int height;
+		short *advance;	/* glyph widths by codepoint, -1 until measured */
 #ifdef XFT
 		XftFont *xftfont;
 		XGlyphInfo *extents;
@@ -57,47 +73,98 @@ typedef struct {
 	} font;
 } DC; /* draw context */
 
-typedef struct Item Item;
-struct Item {
-	char *text;
-	Item *next;		/* traverses all items */
-	Item *left, *right;	/* traverses items matching current search pattern */
-};
+typedef struct {
+	XRectangle r;
+	unsigned long fg, bg;
+	Bool hastext;
+	char text[256];		/* as much as drawtext() looks at */
+} Cell; /* what drawtext() put where in a frame */
+
+typedef struct {
+	int x, y;
+	unsigned int off, len;	/* in the batch's chars */
+} Run; /* string drawn with a core font */
+
+typedef struct {
+	unsigned long pixel;
+#ifdef XFT
+	XftColor xft;
+	XftGlyphFontSpec *glyphs;
+	unsigned int nglyphs, glyphsize;
+#endif
+	XRectangle *rects;	/* backgrounds */
+	unsigned int nrects, rectsize;
+	Run *runs;
+	unsigned int nruns, runsize;
+	char *chars;
+	unsigned int nchars, charsize;
+} Batch; /* what a frame draws in one color */
+
+typedef struct {
+	const char *name;
+	double *us;		/* each time it took, in microseconds */
+	unsigned int n, size;
+} Stat; /* timings of a phase, -stats */
 
 /* forward declarations */
-static void appenditem(Item *i, Item **list, Item **last);
+static int ask(const char *path);
 static void calcoffsetsh(void);
 static void calcoffsetsv(void);
-static char *cistrstr(const char *s, const char *sub);
+static int charw(const char *s, unsigned int n, unsigned int cp);
+static void addstat(unsigned int s, double us);
 static void cleanup(void);
+static double clockus(void);
+static Bool damagecell(const char *text, COL col);
+static Batch *batchof(unsigned long pixel);
+static int doublecmp(const void *a, const void *b);
+static void drawn(double start);
+static void drawbatches(void);
 static void drawmenuh(void);
 static void drawmenuv(void);
 static void drawtext(const char *text, COL col);
-static void eprint(const char *errstr, ...);
+static unsigned int findhit(unsigned int from, unsigned int id);
 static unsigned long getcolor(const char *colstr);
 #ifdef XFT
 static unsigned long getxftcolor(const char *colstr, XftColor *color);
 #endif
 static Bool grabkeyboard(void);
 static void initfont(const char *fontstr);
+static void jumpto(unsigned int n);
+static int itemw(unsigned int i);
+static void keypress(XKeyEvent *e);
 static void kpress(XKeyEvent * e);
 static void resizewindow(void);
 static void match(char *pattern);
-static void readstdin(void);
+static int measure(const char *text, unsigned int len);
+static void matchtail(unsigned int first);
+static double measured(unsigned int s, double start);
+static unsigned int nextchar(const char *s, unsigned int len, unsigned int *cp);
+static unsigned int pageof(Result *r, unsigned int n);
+static double playkey(XKeyEvent *e);
+static void prepare(char *p);
+static void rankpage(void);
+static ssize_t readclient(int fd, char *buf, size_t n, double start);
+static void readinput(void);
+static Bool readrequest(int fd, char *buf, unsigned int size, char **field);
+static void readtail(void);
+static void recordkey(XKeyEvent *e);
 static void run(void);
+static void serve(const char *path);
+static void sessionopts(int argc, char *argv[]);
 static void setup(void);
+static void showdamage(void);
+static double stamp(void);
 static int textnw(const char *text, unsigned int len);
 static int textw(const char *text);
+static void writestats(void);
 
 #include "config.h"
 
 /* variables */
-static char *maxname = NULL;
 static char *prompt = NULL;
 static char *lastitem = NULL; 
 static char *nl = "";
-static char **tokens = NULL;
-static char text[4096];
+static char text[PATTERNSIZE];
 static char hitstxt[16];
 static int cmdw = 0;
 static int promptw = 0;
@@ -121,76 +188,56 @@ static Bool multiselect = False;
 static Bool resize = False;
 static Bool marklastitem = False;
 static Bool indicators = True;
-static Bool xmms = False;
 static Display *dpy;
 static DC dc;
-static Item *allitems = NULL;	/* first of all items */
-static Item *item = NULL;	/* first of pattern matching items */
-static Item *sel = NULL;
-static Item *next = NULL;
-static Item *prev = NULL;
-static Item *curr = NULL;
+static unsigned int sel = 0;	/* positions among the matches */
+static unsigned int next = 0;
+static unsigned int prev = 0;
+static unsigned int curr = 0;
+static Cell *cells = NULL;	/* cells of the frame being drawn */
+static Cell *oldcells = NULL;	/* and of the one on the screen */
+static unsigned int ncells = 0, noldcells = 0, cellsize = 0;
+static XRectangle *damaged = NULL;	/* changed cells */
+static unsigned int ndamaged = 0;
+static Batch *batches = NULL;	/* drawing of the frame, by color */
+static unsigned int nbatches = 0;
 static Window root, win;
-static int (*fstrncmp)(const char *, const char *, size_t n) = strncmp;
-static char *(*fstrstr)(const char *, const char *) = strstr;
 static void (*calcoffsets)(void) = calcoffsetsh;
 static void (*drawmenu)(void) = drawmenuh;
-static char hist[HIST_SIZE][1024];
-static char *histfile = NULL;
-static int hcnt = 0;
-
-static int
-writehistory(char *command) {
-   int i = 0, j = hcnt;
-   FILE *f;
-
-   if(!histfile || strlen(command) <= 0)
-      return 0;
-
-   if( (f = fopen(histfile, "w")) ) {
-      fputs(command, f);
-         fputc('\n', f);
-      for(; i<HIST_SIZE && i<j; i++) {
-         if(strcmp(command, hist[i]) != 0) {
-            fputs(hist[i], f);
-            fputc('\n', f);
-         }
-      }
-      fclose(f);
-      return 1;
-   }
-
-   return 0;
-}
-
-static int
-readhistory (void) {
-   char buf[1024];
-   FILE *f;
-
-
-   if(!histfile)
-      return 0;
-
-   if( (f = fopen(histfile, "r+")) ) {
-      while(fgets(buf, sizeof buf, f) && (hcnt < HIST_SIZE))  
-         strncpy(hist[hcnt++], buf, (strlen(buf) <= 1024) ? strlen(buf): 1024 );
-      fclose(f);
-   }
+static char *serversocket = NULL;	/* -sv */
+static char *clientsocket = NULL;	/* -sc */
+static char opts[1024];		/* the options a server and its clients share */
+static unsigned int optslen = 0;
+static char *statsfile = NULL;	/* -stats */
+static FILE *rec = NULL;	/* -rec */
+static FILE *play = NULL;	/* -play */
+static Bool fastplay = False;	/* -ff */
+static double lastkey = 0;	/* when the last key was recorded */
+static Stat stats[StatLast] = {
+	{ "readhistory" }, { "readstdin" }, { "setup" }, { "grab" }, { "match" }, { "draw" },
+	{ "key" }, { "key.match" }, { "key.draw" },
+};
+static double matchus = 0;	/* spent matching so far */
+static unsigned int keysdue = 0;	/* keys the screen does not show yet */
 
-   return hcnt;
+void
+addstat(unsigned int s, double us) {
+	stats[s].us = grow(stats[s].us, &stats[s].size, stats[s].n + 1, sizeof(double));
+	stats[s].us[stats[s].n++] = us;
 }
 
-void
-appenditem(Item *i, Item **list, Item **last) {
-	if(!(*last))
-		*list = i;
-	else
-		(*last)->right = i;
-	i->left = *last;
-	i->right = NULL;
-	*last = i;
-	++hits;
+Batch *
+batchof(unsigned long pixel) {
+	unsigned int k;
+
+	for(k = 0; k < nbatches; k++)
+		if(batches[k].pixel == pixel)
+			return &batches[k];
+	if(!(batches = realloc(batches, (nbatches + 1) * sizeof(Batch))))
+		eprint("fatal: could not realloc() %u bytes\n", (nbatches + 1) * sizeof(Batch));
+	memset(&batches[nbatches], 0, sizeof(Batch));
+	batches[nbatches].pixel = pixel;
+	return &batches[nbatches++];
 }
 
 void
@@ -198,11 +245,12 @@ calcoffsetsh(void) {
 	static int tw;
 	static unsigned int w;
 
-	if(!curr)
+	if(!hits)
 		return;
+	rankpage();
 	w = promptw + cmdw + 2 * spaceitem;
-	for(next = curr; next; next=next->right) {
-		tw = textw(next->text);
+	for(next = curr; next < hits; next++) {
+		tw = itemw(HIT(next));
 		if(tw > mw / 3)
 			tw = mw / 3;
 		w += tw;
@@ -210,8 +258,8 @@ calcoffsetsh(void) {
 			break;
 	}
 	w = promptw + cmdw + 2 * spaceitem;
-	for(prev = curr; prev && prev->left; prev=prev->left) {
-		tw = textw(prev->left->text);
+	for(prev = curr; prev; prev--) {
+		tw = itemw(HIT(prev - 1));
 		if(tw > mw / 3)
 			tw = mw / 3;
 		w += tw;
@@ -224,55 +272,40 @@ void
 calcoffsetsv(void) {
 	static unsigned int w;
 
-	if(!curr)
+	if(!hits)
 		return;
+	rankpage();
 	w = (dc.font.height + 2) * (lines + 1);
-	for(next = curr; next; next=next->right) {
+	for(next = curr; next < hits; next++) {
 		w -= dc.font.height + 2;
 		if(w <= 0)
 			break;
 	}
 	w = (dc.font.height + 2) * (lines + 1);
-	for(prev = curr; prev && prev->left; prev=prev->left) {
+	for(prev = curr; prev; prev--) {
 		w -= dc.font.height + 2;
 		if(w <= 0)
 			break;
 	}
 }
 
-char *
-cistrstr(const char *s, const char *sub) {
-	int c, csub;
-	unsigned int len;
-
-	if(!sub)
-		return (char *)s;
-	if((c = *sub++) != 0) {
-		c = tolower(c);
-		len = strlen(sub);
-		do {
-			do {
-				if((csub = *s++) == 0)
-					return NULL;
-			}
-			while(tolower(csub) != c);
-		}
-		while(strncasecmp(s, sub, len) != 0);
-		s--;
-	}
-	return (char *)s;
+int
+charw(const char *s, unsigned int n, unsigned int cp) {
+	int w;
+
+	if(cp < ADVANCES && dc.font.advance[cp] >= 0)
+		return dc.font.advance[cp];
+	w = measure(s, n);
+	if(cp < ADVANCES)
+		dc.font.advance[cp] = w;
+	return w;
 }
 
 void
 cleanup(void) {
-	Item *itm;
+	unsigned int k;
 
-	while(allitems) {
-		itm = allitems->next;
-		free(allitems->text);
-		free(allitems);
-		allitems = itm;
-	}
+	cleanupmatch();
 	if(!dc.font.xftfont) {
 		if(dc.font.set)
 			XFreeFontSet(dpy, dc.font.set);
@@ -284,17 +317,100 @@ cleanup(void) {
 	XDestroyWindow(dpy, win);
 	XUngrabKeyboard(dpy, CurrentTime);
 	free(tokens);
+	free(dc.font.advance);
+	free(cells);
+	free(oldcells);
+	free(damaged);
+	for(k = 0; k < nbatches; k++) {
+#ifdef XFT
+		free(batches[k].glyphs);
+#endif
+		free(batches[k].rects);
+		free(batches[k].runs);
+		free(batches[k].chars);
+	}
+	free(batches);
+	for(k = 0; k < StatLast; k++)
+		free(stats[k].us);
+	if(rec)
+		fclose(rec);
+	if(play)
+		fclose(play);
+}
+
+/* the monotonic time in microseconds */
+double
+clockus(void) {
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e6 + ts.tv_nsec / 1e3;
+}
+
+/* Records a cell of the frame being drawn; returns False if the last frame
+ * had the same text in the same colors at the same place. */
+Bool
+damagecell(const char *text, COL col) {
+	Cell *c, *old;
+	unsigned int k;
+
+	if(ncells == cellsize) {
+		cellsize = cellsize ? 2 * cellsize : 64;
+		if(!(cells = realloc(cells, cellsize * sizeof(Cell)))
+		|| !(oldcells = realloc(oldcells, cellsize * sizeof(Cell)))
+		|| !(damaged = realloc(damaged, cellsize * sizeof(XRectangle))))
+			eprint("fatal: could not realloc() %u bytes\n", cellsize * sizeof(Cell));
+	}
+	c = &cells[ncells++];
+	c->r.x = dc.x;
+	c->r.y = dc.y;
+	c->r.width = dc.w;
+	c->r.height = dc.h;
+	c->fg = col.x[ColFG];
+	c->bg = col.x[ColBG];
+	if((c->hastext = text != NULL))
+		strncpy(c->text, text, sizeof c->text);
+	/* cells mostly stay where they were, look there first */
+	for(k = 0; k < noldcells; k++) {
+		old = &oldcells[(ncells - 1 + k) % noldcells];
+		if(!memcmp(&old->r, &c->r, sizeof c->r)) {
+			if(old->fg == c->fg && old->bg == c->bg && old->hastext == c->hastext
+			&& (!c->hastext || !strncmp(old->text, c->text, sizeof c->text)))
+				return False;
+			break;
+		}
+	}
+	damaged[ndamaged++] = c->r;
+	return True;
+}
+
+int
+doublecmp(const void *a, const void *b) {
+	double da = *(double *)a, db = *(double *)b;
+
+	return da < db ? -1 : da > db;
+}
+
+/* a frame is on the screen, the keys it answers took until now */
+void
+drawn(double start) {
+	double t = measured(StatDraw, start);
+	Stat *k = &stats[StatKey];
+
+	for(; statsfile && keysdue; keysdue--) {
+		k->us[k->n - keysdue] = t - k->us[k->n - keysdue];
+		addstat(StatKeyDraw, t - start);
+	}
 }
 
 void
 drawmenuh(void) {
-	static Item *i;
+	unsigned int k;
 
+	/* cells tile the window, the damage tracking relies on it */
 	dc.x = 0;
 	dc.y = 0;
-	dc.w = mw;
 	dc.h = mh;
-	drawtext(NULL, dc.norm);
 	/* print prompt? */
 	if(promptw) {
 		dc.w = promptw;
@@ -303,155 +419,271 @@ drawmenuh(void) {
 	dc.x += promptw;
 	dc.w = mw - promptw;
 	/* print command */
-	if(cmdw && item)
+	if(cmdw && hits)
 		dc.w = cmdw;
 	drawtext(text[0] ? text : NULL, dc.norm);
-	dc.x += cmdw;
-	if(curr) {
+	dc.x += dc.w;
+	if(hits) {
 		dc.w = spaceitem;
-		drawtext((curr && curr->left) ? "<" : NULL, dc.norm);
+		drawtext(curr ? "<" : NULL, dc.norm);
 		dc.x += dc.w;
 		/* determine maximum items */
-		for(i = curr; i != next; i=i->right) {
-			dc.w = textw(i->text);
+		for(k = curr; k < next; k++) {
+			dc.w = itemw(HIT(k));
 			if(dc.w > mw / 3)
 				dc.w = mw / 3;
-			drawtext(i->text, (sel == i) ? dc.sel : dc.norm);
+			drawtext(items.text[HIT(k)], (sel == k) ? dc.sel : dc.norm);
 			dc.x += dc.w;
 		}
+		if(dc.x < mw - spaceitem) {
+			dc.w = mw - spaceitem - dc.x;
+			drawtext(NULL, dc.norm);
+		}
 		dc.x = mw - spaceitem;
 		dc.w = spaceitem;
-		drawtext(next ? ">" : NULL, dc.norm);
+		drawtext(next < hits ? ">" : NULL, dc.norm);
 	}
-	XCopyArea(dpy, dc.drawable, win, dc.gc, 0, 0, mw, mh, 0, 0);
-	XFlush(dpy);
+	showdamage();
 }
 
 void
 drawmenuv(void) {
-	static Item *i;
+	unsigned int k;
+	char *t;
 
+	/* cells tile the window, the damage tracking relies on it */
 	dc.x = 0;
 	dc.y = 0;
-	dc.h = mh;
-	drawtext(NULL, dc.norm);
+	dc.h = dc.font.height + 2;
 	/* print prompt? */
 	if(promptw) {
 		dc.w = promptw;
 		drawtext(prompt, dc.sel);
 	}
 	dc.x += promptw;
-	dc.w = mw - promptw - (hitcounter ? textnw(hitstxt, strlen(hitstxt)) : 0);
-
+	dc.w = mw - promptw - (hitcounter ? textw(hitstxt) : 0);
 	drawtext(text[0] ? text : NULL, dc.norm);
-	if(curr) {
-		if (hitcounter) {
-			dc.w = textw(hitstxt);
-			dc.x = mw - textw(hitstxt);
-			drawtext(hitstxt, dc.norm);
-		}
-		dc.x = 0;
-		dc.w = mw;
+	if (hitcounter) {
+		dc.w = textw(hitstxt);
+		dc.x = mw - textw(hitstxt);
+		drawtext(hitstxt, dc.norm);
+	}
+	dc.x = 0;
+	dc.w = mw;
+	dc.y += dc.font.height + 2;
+	if(hits) {
 		if (indicators) {	
+			drawtext(curr ? "^" : NULL, dc.norm);
 			dc.y += dc.font.height + 2;
-			drawtext((curr && curr->left) ? "^" : NULL, dc.norm);
 		}
-		dc.y += dc.font.height + 2;
 		/* determine maximum items */
-		for(i = curr; i != next; i=i->right) {
-			if((sel != i) && marklastitem && lastitem && !strncmp(lastitem, i->text, strlen(i->text)))
-				drawtext(i->text, dc.last);
+		for(k = curr; k < next; k++) {
+			t = items.text[HIT(k)];
+			if((sel != k) && marklastitem && lastitem && !strncmp(lastitem, t, strlen(t)))
+				drawtext(t, dc.last);
 			else
-				drawtext(i->text, (sel == i) ? dc.sel : dc.norm);
+				drawtext(t, (sel == k) ? dc.sel : dc.norm);
 			dc.y += dc.font.height + 2;
 		}
-		drawtext(indicators && next ? "v" : NULL, dc.norm);
-	} else {
-		if (hitcounter) {
-			dc.w = textw(hitstxt);
-			dc.x = mw - textw(hitstxt);
-			dc.y = 0;
-			drawtext(hitstxt, dc.norm);
+		if (indicators) {
+			drawtext(next < hits ? "v" : NULL, dc.norm);
+			dc.y += dc.font.height + 2;
 		}
-		dc.x = 0;
-		dc.w = mw;
-		dc.h = mh;
-		dc.y += dc.font.height + 2;
+	}
+	if(dc.y < mh) {
+		dc.h = mh - dc.y;
 		drawtext(NULL, dc.norm);
-	} 
-	XCopyArea(dpy, dc.drawable, win, dc.gc, 0, 0, mw, mh, 0, 0);
-	XFlush(dpy);
+	}
+	showdamage();
 }
 
+/* a frame takes one request per background color and, with Xft, one per
+ * text color; core fonts still draw string by string */
 void
-updatemenuv(Bool updown) {
-	static Item *i;
-	
-	if(curr) {
-		dc.x = 0;
-		dc.y = (dc.font.height + 2) * (indicators?2:1);
-		dc.w = mw;
-		dc.h = mh;
-		for(i = curr; i != next; i = i->right) {
-			if(((i == sel->left) && !updown) || (i == sel)
-			||((i == sel->right) && updown)) {
-				if((sel != i) && marklastitem && lastitem && !strncmp(lastitem, i->text, strlen(i->text)))
-					drawtext(i->text, dc.last);
-				else
-					drawtext(i->text, (sel == i) ? dc.sel : dc.norm);
-				XCopyArea(dpy, dc.drawable, win, dc.gc, dc.x, dc.y,
-					dc.w, dc.font.height + 2, dc.x, dc.y);
-			}
-			dc.y += dc.font.height + 2;
+drawbatches(void) {
+	Batch *b;
+	Run *s;
+
+	for(b = batches; b < batches + nbatches; b++)
+		if(b->nrects) {
+			XSetForeground(dpy, dc.gc, b->pixel);
+			XFillRectangles(dpy, dc.drawable, dc.gc, b->rects, b->nrects);
+			b->nrects = 0;
 		}
-	}			
-	XFlush(dpy);
+	for(b = batches; b < batches + nbatches; b++) {
+#ifdef XFT
+		if(b->nglyphs)
+			XftDrawGlyphFontSpec(dc.xftdrawable, &b->xft, b->glyphs, b->nglyphs);
+		b->nglyphs = 0;
+#endif
+		if(b->nruns)
+			XSetForeground(dpy, dc.gc, b->pixel);
+		for(s = b->runs; s < b->runs + b->nruns; s++)
+			if(dc.font.set)
+				XmbDrawString(dpy, dc.drawable, dc.font.set, dc.gc, s->x, s->y,
+				              b->chars + s->off, s->len);
+			else
+				XDrawString(dpy, dc.drawable, dc.gc, s->x, s->y,
+				            b->chars + s->off, s->len);
+		b->nruns = b->nchars = 0;
+	}
 }
 
 void
 drawtext(const char *text, COL col) {
 	char buf[256];
-	int i, x, y, h, len, olen;
+	int x, y, h, len, w, off[sizeof buf], pw[sizeof buf];
+	unsigned int k, lo, hi, n, nc, cp;
 	XRectangle r = { dc.x, dc.y, dc.w, dc.h };
 
-	XSetForeground(dpy, dc.gc, col.x[ColBG]);
-	XFillRectangles(dpy, dc.drawable, dc.gc, &r, 1);
+	Batch *b;
+#ifdef XFT
+	XftGlyphFontSpec *g;
+#endif
+
+	if(!damagecell(text, col))
+		return;
+	/* queued, drawbatches() draws the frame */
+	b = batchof(col.x[ColBG]);
+	b->rects = grow(b->rects, &b->rectsize, b->nrects + 1, sizeof(XRectangle));
+	b->rects[b->nrects++] = r;
 	if(!text)
 		return;
-	olen = strlen(text);
 	h = dc.font.height;
 	y = dc.y + ((h + 2) / 2) - (h / 2) + dc.font.ascent;
 	x = dc.x + (h / 2);
-	/* shorten text if necessary */
-	for(len = MIN(olen, sizeof buf); len && textnw(text, len) > dc.w - h; len--);
-	if(!len)
-		return;
-	memcpy(buf, text, len);
-	if(len < olen)
-		for(i = len; i && i > len - 3; buf[--i] = '.');
-#ifdef XFT
-	if(dc.font.xftfont)
-		XftDrawStringUtf8(dc.xftdrawable, &col.xft[ColFG], dc.font.xftfont, x, y, (unsigned char*) buf, len);
-	else {
-#endif
-	XSetForeground(dpy, dc.gc, col.x[ColFG]);
-	if(dc.font.set)
-		XmbDrawString(dpy, dc.drawable, dc.font.set, dc.gc, x, y, buf, len);
+	/* widths of the prefixes up to each character, until one is too wide */
+	for(len = 0, w = 0, nc = 0; text[len] && len < sizeof buf - 3 && w <= dc.w - h; len += n) {
+		n = nextchar(text + len, sizeof buf - 3 - len, &cp);
+		off[nc] = len;
+		pw[nc++] = w;
+		w += charw(text + len, n, cp);
+	}
+	if(text[len] || w > dc.w - h) {
+		/* shorten text, cut at the last character after which "..." fits */
+		w = textnw("...", 3);
+		for(lo = 0, hi = nc ? nc - 1 : 0; lo < hi;) {
+			k = lo + (hi - lo + 1) / 2;
+			if(pw[k] + w <= dc.w - h)
+				lo = k;
+			else
+				hi = k - 1;
+		}
+		if(!nc || pw[lo] + w > dc.w - h)
+			return;
+		len = off[lo];
+		memcpy(buf + len, "...", 3);
+		memcpy(buf, text, len);
+		len += 3;
+	}
 	else
-		XDrawString(dpy, dc.drawable, dc.gc, x, y, buf, len);
+		memcpy(buf, text, len);
+	b = batchof(col.x[ColFG]);
 #ifdef XFT
+	if(dc.font.xftfont) {
+		b->xft = col.xft[ColFG];
+		b->glyphs = grow(b->glyphs, &b->glyphsize, b->nglyphs + len, sizeof(XftGlyphFontSpec));
+		/* placed by the cached widths the text was shortened with */
+		for(k = 0; k < len; k += n) {
+			n = nextchar(buf + k, len - k, &cp);
+			g = &b->glyphs[b->nglyphs++];
+			g->font = dc.font.xftfont;
+			g->glyph = XftCharIndex(dpy, dc.font.xftfont, cp);
+			g->x = x;
+			g->y = y;
+			x += charw(buf + k, n, cp);
+		}
+		return;
 	}
 #endif
+	b->runs = grow(b->runs, &b->runsize, b->nruns + 1, sizeof(Run));
+	b->chars = grow(b->chars, &b->charsize, b->nchars + len, 1);
+	b->runs[b->nruns].x = x;
+	b->runs[b->nruns].y = y;
+	b->runs[b->nruns].off = b->nchars;
+	b->runs[b->nruns++].len = len;
+	memcpy(b->chars + b->nchars, buf, len);
+	b->nchars += len;
 }
 
-void
-eprint(const char *errstr, ...) {
-	va_list ap;
+/* Hands the request to a dmenu serving path and prints its answer; returns
+ * the exit status of the session there, or -1 if no server takes it. */
+int
+ask(const char *path) {
+	struct sockaddr_un sa;
+	struct pollfd pfd[2];
+	char buf[BUFSIZ], last;
+	ssize_t n;
+	int fd, nfds;
+	Bool pass = !cachefile, held = False;
+
+	if(strlen(path) >= sizeof sa.sun_path || (fd = socket(AF_UNIX, SOCK_STREAM, 0)) == -1)
+		return -1;
+	memset(&sa, 0, sizeof sa);
+	sa.sun_family = AF_UNIX;
+	strcpy(sa.sun_path, path);
+	if(connect(fd, (struct sockaddr *)&sa, sizeof sa) == -1) {
+		close(fd);
+		return -1;
+	}
+	signal(SIGPIPE, SIG_IGN);
+	/* "i" when the items follow, "w" for those of the cache, then the cache,
+	 * the prompt and the options, which have to be the server's */
+	n = snprintf(buf, sizeof buf, "%c%c%s%c%s%c%u%c", pass ? 'i' : 'w', 0,
+	             cachefile ? cachefile : "", 0, prompt ? prompt : "", 0, optslen, 0);
+	if(n < 0 || n + optslen > sizeof buf) {
+		close(fd);
+		return -1;
+	}
+	memcpy(buf + n, opts, optslen);
+	n += optslen;
+	/* the items are only passed on once the server said yes, a refused
+	 * client, or one the server is too busy for, still has them for its
+	 * own menu */
+	if(write(fd, buf, n) != n || readclient(fd, buf, 1, clockus()) != 1 || buf[0] != 'y'
+	|| (!pass && shutdown(fd, SHUT_WR) == -1)) {
+		close(fd);
+		return -1;
+	}
+	pfd[0].fd = fd;
+	pfd[1].fd = STDIN_FILENO;
+	pfd[0].events = pfd[1].events = POLLIN;
+	/* pass the items on while the answer may already come */
+	for(nfds = pass ? 2 : 1; poll(pfd, nfds, -1) != -1 || errno == EINTR;) {
+		if(nfds == 2 && pfd[1].revents) {
+			if((n = read(STDIN_FILENO, buf, sizeof buf)) <= 0 || write(fd, buf, n) != n) {
+				shutdown(fd, SHUT_WR);
+				nfds = 1;
+			}
+		}
+		if(pfd[0].revents) {
+			if((n = read(fd, buf, sizeof buf)) <= 0)
+				break;
+			/* the answer ends in the exit status, hold the last byte back */
+			if(held)
+				putchar(last);
+			fwrite(buf, 1, n - 1, stdout);
+			last = buf[n - 1];
+			held = True;
+		}
+	}
+	fflush(stdout);
+	close(fd);
+	return held ? (unsigned char)last : 1;
+}
 
-	va_start(ap, errstr);
-	vfprintf(stderr, errstr, ap);
-	va_end(ap);
-	exit(EXIT_FAILURE);
+/* the position of item id among the matches, looked for from where it was */
+unsigned int
+findhit(unsigned int from, unsigned int id) {
+	unsigned int k;
+
+	for(k = from; k < hits; k++)
+		if(HIT(k) == id)
+			return k;
+	for(k = 0; k < from && k < hits; k++)
+		if(HIT(k) == id)
+			return k;
+	return 0;
 }
 
 unsigned long
@@ -476,24 +708,61 @@ getxftcolor(const char *colstr, XftColor *color) {
 }
 #endif
 
+/* Grabs the keyboard, waiting up to a second for whoever has it to let go.
+ * Giving it up moves the focus, which the root hears about as a FocusIn or
+ * a FocusOut, and a menu that had it often unmaps for a window that maps.
+ * The grab is tried again on those, and every 8ms at the latest in case the
+ * release showed nowhere we listen. */
 Bool
 grabkeyboard(void) {
-	unsigned int len;
-
-	for(len = 1000; len; len--) {
-		if(XGrabKeyboard(dpy, root, True, GrabModeAsync, GrabModeAsync, CurrentTime)
-		== GrabSuccess)
+	struct pollfd pfd = { ConnectionNumber(dpy), POLLIN, 0 };
+	struct timespec start, t;
+	XEvent ev;
+	int ms, r, wait = 1;
+	Bool grabbed, retry;
+	double began = stamp();
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	XSelectInput(dpy, root, FocusChangeMask | SubstructureNotifyMask);
+	while(!(grabbed = XGrabKeyboard(dpy, root, True, GrabModeAsync, GrabModeAsync, CurrentTime)
+	                  == GrabSuccess)) {
+		for(retry = False; !retry;) {
+			/* the root's events are ours alone, the others stay queued
+			 * and poll() only wakes for new ones */
+			if(XCheckWindowEvent(dpy, root, FocusChangeMask | SubstructureNotifyMask, &ev)) {
+				retry = ev.type == FocusIn || ev.type == FocusOut || ev.type == MapNotify;
+				continue;
+			}
+			clock_gettime(CLOCK_MONOTONIC, &t);
+			if((ms = (t.tv_sec - start.tv_sec) * 1000 + (t.tv_nsec - start.tv_nsec) / 1000000) >= 1000)
+				break;
+			if((r = poll(&pfd, 1, MIN(wait, 1000 - ms))) == 0)
+				retry = True;
+			else if(r == -1 && errno != EINTR)
+				break;
+		}
+		if(!retry)
 			break;
-		usleep(1000);
+		wait = MIN(2 * wait, 8);
 	}
-	return len > 0;
+	XSelectInput(dpy, root, NoEventMask);
+	measured(StatGrab, began);
+	return grabbed;
 }
 
 void
 initfont(const char *fontstr) {
+	unsigned int k;
+
+	/* widths measured in another font are stale */
+	for(k = 0; k < nitems; k++)
+		items.w[k] = 0;
+	if(!dc.font.advance && !(dc.font.advance = malloc(ADVANCES * sizeof(short))))
+		eprint("fatal: could not malloc() %u bytes\n", ADVANCES * sizeof(short));
+	memset(dc.font.advance, 0xff, ADVANCES * sizeof(short));
 #ifdef XFT
 	dc.font.xftfont = 0;
-	if(cistrstr(fontstr,"xft:")) {
+	if(!strncasecmp(fontstr, "xft:", 4)) {
 		dc.font.xftfont = XftFontOpenXlfd(dpy, screen, fontstr+4);
 		if(!dc.font.xftfont)
 			dc.font.xftfont = XftFontOpenName(dpy, screen, fontstr+4);
@@ -544,6 +813,40 @@ initfont(const char *fontstr) {
 #endif
 }
 
+int
+itemw(unsigned int i) {
+	if(!items.w[i])
+		items.w[i] = textw(items.text[i]);
+	return items.w[i];
+}
+
+/* shows the nth match, selected, on its page */
+void
+jumpto(unsigned int n) {
+	Result *r;
+
+	if(!nresults || n >= (r = &results[nresults - 1])->n)
+		return;
+	rank(r, n + 1);
+	curr = pageof(r, n);
+	sel = n;
+	calcoffsets();
+}
+
+/* handles a key, timing it with -stats */
+void
+keypress(XKeyEvent *e) {
+	double t = stamp(), m = matchus;
+
+	kpress(e);
+	if(statsfile) {
+		/* the key's time runs until drawn() */
+		addstat(StatKey, t);
+		addstat(StatKeyMatch, matchus - m);
+		keysdue++;
+	}
+}
+
 void
 kpress(XKeyEvent * e) {
 	char buf[32];
@@ -551,6 +854,8 @@ kpress(XKeyEvent * e) {
 	unsigned int len;
 	KeySym ksym;
 
+	if(rec)
+		recordkey(e);
 	len = strlen(text);
 	buf[0] = 0;
 	num = XLookupString(e, buf, sizeof buf, &ksym, NULL);
@@ -588,7 +893,6 @@ kpress(XKeyEvent * e) {
 		case XK_U:
 			text[0] = 0;
 			match(text);
-			drawmenu();
 			return;
 		case XK_w:
 		case XK_W:
@@ -599,7 +903,6 @@ kpress(XKeyEvent * e) {
 				while(i >= 0 && text[i] != ' ')
 					text[i--] = 0;
 				match(text);
-				drawmenu();
 			}
 			return;
 		}
@@ -642,51 +945,40 @@ kpress(XKeyEvent * e) {
 		}
 		break;
 	case XK_End:
-		if(!item)
+		if(!hits)
 			return;
-		while(next) {
-			sel = curr = next;
-			calcoffsets();
-		}
-		while(sel && sel->right)
-			sel = sel->right;
+		jumpto(hits - 1);
 		break;
 	case XK_Escape:
 		ret = 1;
 		running = False;
 		break;
 	case XK_Home:
-		if(!item)
+		if(!hits)
 			return;
-		sel = curr = item;
-		calcoffsets();
+		jumpto(0);
 		break;
 	case XK_Left:
 	case XK_Up:
-		if(!(sel && sel->left))
+		if(!(hits && sel))
 			return;
-		sel=sel->left;
-		if(sel->right == curr) {
+		sel--;
+		if(sel + 1 == curr) {
 			if (vlist)
-				curr = curr->left;
+				curr--;
 			else
 				curr = prev;
 			calcoffsets();
-		} else {
-			if (vlist) {
-				updatemenuv(True);
-				return;
-			}
 		}
 		break;
 	case XK_Next:
-		if(!next)
+		if(next >= hits)
 			return;
 		sel = curr = next;
 		calcoffsets();
 		break;
 	case XK_Prior:
-		if(!prev)
+		if(!hits)
 			return;
 		sel = curr = prev;
 		calcoffsets();
@@ -694,42 +986,38 @@ kpress(XKeyEvent * e) {
 	case XK_Return:
 		if((e->state & ShiftMask) && *text)
 			fprintf(stdout, "%s%s", text, nl);
-		else if(sel) {
-			fprintf(stdout, "%s%s", sel->text, nl);
-			lastitem = sel->text;
+		else if(hits) {
+			fprintf(stdout, "%s%s", items.text[HIT(sel)], nl);
+			lastitem = items.text[HIT(sel)];
 		}
 		else if(*text)
 			fprintf(stdout, "%s%s", text, nl);
-        writehistory( (sel == NULL) ? text : sel->text);
+		writehistory(hits ? items.text[HIT(sel)] : text, hits ? (int)HIT(sel) : -1);
 		fflush(stdout);
 		running = multiselect;
 		break;
 	case XK_Right:
 	case XK_Down:
-		if(!(sel && sel->right))
+		if(sel + 1 >= hits)
 			return;
-		sel=sel->right;
+		sel++;
 		if(sel == next) {
 			if (vlist)
-				curr = curr->right;
+				curr++;
 			else
 				curr = next;
 			calcoffsets();
-		} else {
-			if (vlist) {
-				updatemenuv(False);
-				return;
-			}
 		}
 		break;
 	case XK_Tab:
-		if(!sel)
+		if(!hits)
 			return;
-		strncpy(text, sel->text, sizeof text);
+		/* items are no longer cut to fit the pattern */
+		strncpy(text, items.text[HIT(sel)], sizeof text - 1);
+		text[sizeof text - 1] = 0;
 		match(text);
 		break;
 	}
-	drawmenu();
 }
 
 void resizewindow(void)
@@ -744,158 +1032,510 @@ void resizewindow(void)
 	}
 }
 
-unsigned int tokenize(char *pat, char **tok)
-{
-	unsigned int i = 0;
-	char tmp[4096] = {0};
-
-	strncpy(tmp, pat, strlen(pat));
-	tok[0] = strtok(tmp, " ");
+unsigned int
+nextchar(const char *s, unsigned int len, unsigned int *cp) {
+	const unsigned char *u = (const unsigned char *)s;
+	unsigned int k, n;
+	Bool utf8 = dc.font.set != NULL;
 
-	while(tok[i] && i < maxtokens)
-		tok[++i] = strtok(NULL, " ");
-	return i;
+#ifdef XFT
+	utf8 = utf8 || dc.font.xftfont;
+#endif
+	/* core fonts draw a glyph per byte */
+	if(!utf8 || u[0] < 0x80) {
+		*cp = u[0];
+		return 1;
+	}
+	n = u[0] >= 0xf0 ? 4 : u[0] >= 0xe0 ? 3 : u[0] >= 0xc0 ? 2 : 1;
+	*cp = u[0] & (0x7f >> n);
+	for(k = 1; k < n && k < len && (u[k] & 0xc0) == 0x80; k++)
+		*cp = *cp << 6 | (u[k] & 0x3f);
+	if(n == 1 || k < n)
+		*cp = ~0U; /* invalid, measured but not cached */
+	return k;
 }
 
 void
 match(char *pattern) {
-	unsigned int plen, tokencnt = 0;
-	char append = 0;
-	Item *i, *itemend, *lexact, *lprefix, *lsubstr, *exactend, *prefixend, *substrend;
+	Result *r;
+	double t;
 
 	if(!pattern)
 		return;
+	t = stamp();
+	r = filter(pattern);
+	matchus += measured(StatMatch, t) - t;
+	hits = r->n;
+	curr = prev = next = sel = 0;
+	calcoffsets();
+	resizewindow();
+	snprintf(hitstxt, sizeof(hitstxt), "(%d)", hits);
+}
 
-	if(!xmms)
-		tokens[(tokencnt = 1)-1] = pattern;
-	else
-		if(!(tokencnt = tokenize(pattern, tokens)))
-			tokens[(tokencnt = 1)-1] = "";
-
-	item = lexact = lprefix = lsubstr = itemend = exactend = prefixend = substrend = NULL;
-	for(i = allitems; i; i = i->next) {
-		for(int j = 0; j < tokencnt; ++j) {
-			plen = strlen(tokens[j]);
-			if(!fstrncmp(tokens[j], i->text, plen + 1))
-				append = !append || append > 1 ? 1 : append;
-			else if(!fstrncmp(tokens[j], i->text, plen ))
-				append = !append || append > 2 ? 2 : append;
-			else if(fstrstr(i->text, tokens[j]))
-				append = append > 0 && append < 3 ? append : 3;
-			else {
-				append = 0;
-				break;
-			}
-		}
-		if(append == 1)
-			appenditem(i, &lexact, &exactend);
-		else if(append == 2)
-			appenditem(i, &lprefix, &prefixend);
-		else if(append == 3)
-			appenditem(i, &lsubstr, &substrend);
+void
+matchtail(unsigned int first) {
+	Bool attop = !curr, selattop = !sel;
+	unsigned int currid = hits ? HIT(curr) : 0, selid = hits ? HIT(sel) : 0;
+	double t = stamp();
+
+	if(!filtertail(first))
+		return;
+	matchus += measured(StatMatch, t) - t;
+	/* the view stays on its items, which the new ones may have moved */
+	hits = results[nresults - 1].n;
+	curr = attop ? 0 : findhit(curr, currid);
+	sel = selattop ? 0 : findhit(sel, selid);
+	calcoffsets();
+	resizewindow();
+	snprintf(hitstxt, sizeof(hitstxt), "(%d)", hits);
+}
+
+/* adds the time since start to stat s with -stats; returns the time */
+double
+measured(unsigned int s, double start) {
+	double t = stamp();
+
+	if(statsfile)
+		addstat(s, t - start);
+	return t;
+}
+
+/* width of text as drawn, not counting the padding textw() adds */
+int
+measure(const char *text, unsigned int len) {
+#ifdef XFT
+	if (dc.font.xftfont) {
+		XftTextExtentsUtf8(dpy, dc.font.xftfont, (unsigned const char *) text, len, dc.font.extents);
+		if(dc.font.extents->height > dc.font.height)
+			dc.font.height = dc.font.extents->height;
+		return dc.font.extents->xOff;
 	}
-	if(lexact) {
-		item = lexact;
-		itemend = exactend;
+	else {
+#endif
+	XRectangle r;
+
+	if(dc.font.set) {
+		XmbTextExtents(dc.font.set, text, len, NULL, &r);
+		return r.width;
 	}
-	if(lprefix) {
-		if(itemend) {
-			itemend->right = lprefix;
-			lprefix->left = itemend;
-		}
-		else
-			item = lprefix;
-		itemend = prefixend;
+	return XTextWidth(dc.font.xfont, text, len);
+#ifdef XFT
 	}
-	if(lsubstr) {
-		if(itemend) {
-			itemend->right = lsubstr;
-			lsubstr->left = itemend;
+#endif
+}
+
+/* Returns the first item of the page holding the nth item, the pages counted
+ * from the first item on. Horizontal pages are found once per result set as
+ * far as needed, then looked up by binary search. */
+unsigned int
+pageof(Result *r, unsigned int n) {
+	unsigned int k, lo, hi, w, tw;
+
+	if(vlist)
+		return n - n % MAX(lines, 1);
+	while(!r->paged && (!r->npages || r->pages[r->npages - 1] <= n)) {
+		/* the page after the last one known, as calcoffsetsh() fills it */
+		k = r->npages ? r->pages[r->npages - 1] : 0;
+		if(r->npages) {
+			w = promptw + cmdw + 2 * spaceitem;
+			for(; k < r->n; k++) {
+				if(r->keys && k >= r->nranked)
+					rank(r, k + 1);
+				tw = MIN(itemw(r->items[k]), mw / 3);
+				if((w += tw) > mw)
+					break;
+			}
+			k = MAX(k, r->pages[r->npages - 1] + 1);
+		}
+		if(k >= r->n) {
+			r->paged = True;
+			break;
 		}
+		r->pages = grow(r->pages, &r->pagesize, r->npages + 1, sizeof(unsigned int));
+		r->pages[r->npages++] = k;
+	}
+	for(lo = 0, hi = r->npages; hi - lo > 1;)
+		if(r->pages[(lo + hi) / 2] <= n)
+			lo = (lo + hi) / 2;
 		else
-			item = lsubstr;
+			hi = (lo + hi) / 2;
+	return r->pages[lo];
+}
+
+/* Reads the next key of the trace into e; returns its delay after the one
+ * before in microseconds, or -1 after the last one. */
+double
+playkey(XKeyEvent *e) {
+	char name[64];
+	unsigned int state;
+	double delay;
+
+	if(fscanf(play, "%lf %x %63s", &delay, &state, name) != 3)
+		return -1;
+	memset(e, 0, sizeof *e);
+	e->type = KeyPress;
+	e->display = dpy;
+	e->window = win;
+	e->root = root;
+	e->time = CurrentTime;
+	e->same_screen = True;
+	e->state = state;
+	/* the keycode of the symbol here, the trace may come from another keyboard */
+	e->keycode = XKeysymToKeycode(dpy, XStringToKeysym(name));
+	return delay;
+}
+
+void
+rankpage(void) {
+	Result *r;
+
+	if(!nresults || !(r = &results[nresults - 1])->keys || r->nranked >= r->n)
+		return;
+	/* rank on before the view reaches the first unranked item */
+	if(curr + MAX(lines, RANKCHUNK) > r->nranked)
+		rank(r, curr + MAX(lines, RANKCHUNK) + RANKCHUNK);
+}
+
+/* reads the history, then the items */
+void
+readinput(void) {
+	double t = stamp();
+
+	readhistory();
+	t = measured(StatHistory, t);
+	readstdin();
+	measured(StatInput, t);
+}
+
+/* Reads up to n bytes of a request or its answer that began at start, or
+ * fails once the other side took a second for it. */
+ssize_t
+readclient(int fd, char *buf, size_t n, double start) {
+	struct pollfd pfd = { fd, POLLIN, 0 };
+	double left;
+	int r;
+
+	while((left = start + 1e6 - clockus()) > 0) {
+		if((r = poll(&pfd, 1, left / 1000 + 1)) > 0)
+			return read(fd, buf, n);
+		if(r == -1 && errno != EINTR)
+			break;
 	}
-	curr = prev = next = sel = item;
-	calcoffsets();
-	resizewindow();
-	snprintf(hitstxt, sizeof(hitstxt), "(%d)", hits);
-	hits = 0;
+	return -1;
+}
+
+/* Reads a client's request into buf: the kind, cache, prompt and options
+ * length as NUL terminated fields, then the options. Nothing after it is
+ * read, that is the items. */
+Bool
+readrequest(int fd, char *buf, unsigned int size, char **field) {
+	unsigned int n = 0, k = 0, len;
+	double start = clockus();
+	ssize_t r;
+
+	for(field[0] = buf; k < 4; n++) {
+		if(n == size || readclient(fd, &buf[n], 1, start) != 1)
+			return False;
+		if(!buf[n] && ++k < 4)
+			field[k] = &buf[n + 1];
+	}
+	field[4] = &buf[n];
+	if((len = atoi(field[3])) > size - n)
+		return False;
+	for(k = 0; k < len; k += r)
+		if((r = readclient(fd, field[4] + k, len - k, start)) <= 0)
+			return False;
+	return len == optslen && !memcmp(field[4], opts, len);
 }
 
 void
-readstdin(void) {
-	char *p, buf[1024];
-	unsigned int len = 0, max = 0;
-	Item *i, *new;
-	int k;
-
-	i = 0;
-	if( readhistory() )  {
-       for(k=0; k<hcnt; k++) {
-          len = strlen(hist[k]);
-          if (hist[k][len - 1] == '\n')
-             hist[k][len - 1] = 0;
-          p = strdup(hist[k]);
-          if(max < len) {
-             maxname = p;
-             max = len;
-          }
-          if((new = (Item *)malloc(sizeof(Item))) == NULL)
-             eprint("fatal: could not malloc() %u bytes\n", sizeof(Item));
-          new->next = new->left = new->right = NULL;
-          new->text = p;
-          if(!i)
-             allitems = new;
-          else 
-             i->next = new;
-          i = new;
-       }
-    }
-    len=0; max=0;
-
-	while(fgets(buf, sizeof buf, stdin)) {
-		len = strlen(buf);
-		if (buf[len - 1] == '\n')
-			buf[len - 1] = 0;
-		if(!(p = strdup(buf)))
-			eprint("fatal: could not strdup() %u bytes\n", strlen(buf));
-		if(max < len) {
-			maxname = p;
-			max = len;
+readtail(void) {
+	struct pollfd pfd = { STDIN_FILENO, POLLIN, 0 };
+	char *longest = maxname;
+	unsigned int k, tail = nitems, reads = 0;
+
+	/* take what is there, but give keystrokes a chance in between */
+	while((streaming = readblock()) && ++reads < 16 && poll(&pfd, 1, 0) > 0);
+	if(!streaming)
+		histitems();
+	matchtail(tail);
+	if(maxname != longest) {
+		cmdw = MIN(textw(maxname), mw / 3);
+		/* the pages hold fewer items now */
+		for(k = 0; k < nresults; k++) {
+			results[k].npages = 0;
+			results[k].paged = False;
 		}
-		if(!(new = (Item *)malloc(sizeof(Item))))
-			eprint("fatal: could not malloc() %u bytes\n", sizeof(Item));
-		new->next = new->left = new->right = NULL;
-		new->text = p;
-		if(!i)
-			allitems = new;
-		else 
-			i->next = new;
-		i = new;
+		calcoffsets();
 	}
 }
 
+/* appends "delay state keysym" to the trace, the delay in microseconds
+ * since the last key or since the menu showed up */
+void
+recordkey(XKeyEvent *e) {
+	double t = clockus();
+	char *name = XKeysymToString(XLookupKeysym(e, 0));
+
+	fprintf(rec, "%.0f %#x %s\n", t - lastkey, e->state, name ? name : "NoSymbol");
+	fflush(rec);
+	lastkey = t;
+}
+
 void
 run(void) {
 	XEvent ev;
-
+	XKeyEvent key;
+	Bool dirty = False;
+	double t, due = -1;
+	struct pollfd pfd[2] = {
+		{ ConnectionNumber(dpy), POLLIN, 0 },
+		{ STDIN_FILENO, POLLIN, 0 }
+	};
+
+	/* the delays of the trace count from when the menu shows up */
+	lastkey = clockus();
+	if(play && (t = playkey(&key)) >= 0)
+		due = lastkey + t;
 	/* main event loop */
-	while(running && !XNextEvent(dpy, &ev))
+	while(running) {
+		/* one frame for everything that happened since the last one, a key
+		 * of the trace that is due is pending too */
+		if(dirty && !XPending(dpy) && (due < 0 || fastplay || due > clockus())) {
+			t = stamp();
+			drawmenu();
+			drawn(t);
+			dirty = False;
+		}
+		if(due >= 0 && !XPending(dpy)) {
+			/* X events and input until the trace's next key is due, with -ff
+			 * one frame after the other */
+			if(!fastplay && (t = due - clockus()) > 0) {
+				pfd[1].revents = 0;
+				if(poll(pfd, streaming ? 2 : 1, t / 1000 + 1) == -1 && errno != EINTR)
+					eprint("fatal: poll failed\n");
+				if(pfd[1].revents) {
+					readtail();
+					dirty = True;
+				}
+				continue;
+			}
+			keypress(&key);
+			dirty = True;
+			if((t = playkey(&key)) >= 0)
+				due += t;
+			else {
+				due = -1;
+				/* a trace that ends before the menu does ends it as Escape */
+				if(running) {
+					ret = 1;
+					running = False;
+				}
+			}
+			continue;
+		}
+		if(streaming && !XPending(dpy)) {
+			if(poll(pfd, 2, -1) == -1 && errno != EINTR)
+				eprint("fatal: poll failed\n");
+			if(pfd[1].revents) {
+				readtail();
+				dirty = True;
+			}
+			continue;
+		}
+		if(XNextEvent(dpy, &ev))
+			break;
 		switch (ev.type) {
 		default:	/* ignore all crap */
 			break;
 		case KeyPress:
-			kpress(&ev.xkey);
+			keypress(&ev.xkey);
+			dirty = True;
 			break;
 		case Expose:
-			if(ev.xexpose.count == 0)
-				drawmenu();
+			/* the pixmap still holds the last frame */
+			XCopyArea(dpy, dc.drawable, win, dc.gc, ev.xexpose.x, ev.xexpose.y,
+			          ev.xexpose.width, ev.xexpose.height, ev.xexpose.x, ev.xexpose.y);
 			break;
 		}
+	}
+	/* keys without a frame, like the last one, show nothing, neither their
+	 * time nor their matching counts */
+	stats[StatKey].n -= keysdue;
+	stats[StatKeyMatch].n -= keysdue;
+	keysdue = 0;
+}
+
+/* puts what changed since the last frame on the screen */
+void
+showdamage(void) {
+	Cell *c;
+	unsigned int k;
+
+	drawbatches();
+	if(ndamaged > 2) {
+		/* one copy, clipped to the damage */
+		XSetClipRectangles(dpy, dc.gc, 0, 0, damaged, ndamaged, Unsorted);
+		XCopyArea(dpy, dc.drawable, win, dc.gc, 0, 0, mw, mh, 0, 0);
+		XSetClipMask(dpy, dc.gc, None);
+	}
+	else
+		for(k = 0; k < ndamaged; k++)
+			XCopyArea(dpy, dc.drawable, win, dc.gc, damaged[k].x, damaged[k].y,
+			          damaged[k].width, damaged[k].height, damaged[k].x, damaged[k].y);
+	XFlush(dpy);
+	ndamaged = 0;
+	c = oldcells;
+	oldcells = cells;
+	cells = c;
+	noldcells = ncells;
+	ncells = 0;
+}
+
+/* puts the first frame of a session with prompt p in the pixmap */
+void
+prepare(char *p) {
+	double t;
+
+	prompt = p;
+	promptw = prompt ? MIN(textw(prompt), mw / 5) : 0;
+	cmdw = maxname ? MIN(textw(maxname), mw / 3) : 0;
+	while(nresults)
+		popresult();
+	text[0] = 0;
+	match(text);
+	t = stamp();
+	drawmenu();
+	drawn(t);
+}
+
+/* Answers the clients of the socket at path one after the other. The display,
+ * fonts, colors, window and the last items stay from one to the next, and the
+ * next menu is drawn ahead, so that showing it is a grab and a map. Clients
+ * with other options are turned away and show their menu themselves. */
+void
+serve(const char *path) {
+	static char request[BUFSIZ], cache[BUFSIZ], promptbuf[BUFSIZ];
+	struct sockaddr_un sa;
+	struct stat st;
+	char *cf, *p, *field[5], c;
+	int sfd, fd, null;
+	Bool stream = streaming, reload, same, ok;
+
+	signal(SIGPIPE, SIG_IGN);
+	if(strlen(path) >= sizeof sa.sun_path)
+		eprint("dmenu: socket path too long '%s'\n", path);
+	memset(&sa, 0, sizeof sa);
+	sa.sun_family = AF_UNIX;
+	strcpy(sa.sun_path, path);
+	unlink(path);
+	if((sfd = socket(AF_UNIX, SOCK_STREAM, 0)) == -1
+	|| bind(sfd, (struct sockaddr *)&sa, sizeof sa) == -1 || listen(sfd, 8) == -1)
+		eprint("dmenu: cannot listen on '%s'\n", path);
+	if((null = open("/dev/null", O_RDWR)) == -1)
+		eprint("dmenu: cannot open /dev/null\n");
+	reload = False;
+	for(;;) {
+		/* what was chosen last time counts from now on */
+		refreshhistory();
+		prepare(prompt);
+		XFlush(dpy);
+		while((fd = accept(sfd, NULL, NULL)) == -1)
+			if(errno != EINTR && errno != ECONNABORTED)
+				eprint("dmenu: cannot accept on '%s'\n", path);
+		ok = readrequest(fd, request, sizeof request, field)
+		  && (!strcmp(field[0], "i") || (!strcmp(field[0], "w") && *field[1]));
+		/* a cache that changed is mapped before the answer, a broken one
+		 * turns the client away and leaves the items as they are */
+		if(ok && *field[0] == 'w' && (reload || !cachefile || strcmp(field[1], cachefile)
+		|| stat(field[1], &st) == -1 || st.st_ino != cachestat.st_ino
+		|| st.st_mtime != cachestat.st_mtime || st.st_size != cachestat.st_size)) {
+			if((ok = checkcache(field[1])))
+				reload = True;
+		}
+		if(!ok) {
+			write(fd, "n", 1);
+			close(fd);
+			continue;
+		}
+		/* a client that gave up waiting is gone */
+		if(write(fd, "y", 1) != 1) {
+			close(fd);
+			continue;
+		}
+		/* the session's stdin and stdout are the client */
+		dup2(fd, STDIN_FILENO);
+		dup2(fd, STDOUT_FILENO);
+		close(fd);
+		/* the prompt outlives the request */
+		p = *field[2] ? field[2] : NULL;
+		if((same = p ? prompt && !strcmp(p, prompt) : !prompt))
+			p = prompt;
+		else if(p)
+			p = strcpy(promptbuf, p);
+		if(*field[0] == 'w' && (!cachefile || strcmp(field[1], cachefile)))
+			cachefile = strcpy(cache, field[1]);
+		if(*field[0] == 'i' || reload) {
+			freeitems();
+			lastitem = NULL;
+			streaming = stream;
+			/* the client's items rather than the cache, until the next "w" */
+			cf = cachefile;
+			if(*field[0] == 'i')
+				cachefile = NULL;
+			readinput();
+			cachefile = cf;
+			reload = *field[0] == 'i';
+			prepare(p);
+		}
+		else if(!same)
+			prepare(p);
+		ret = 0;
+		if((running = grabkeyboard())) {
+			/* the server paints the frame from the pixmap on mapping */
+			XSetWindowBackgroundPixmap(dpy, win, dc.drawable);
+			XMapRaised(dpy, win);
+			run();
+			XUnmapWindow(dpy, win);
+			XUngrabKeyboard(dpy, CurrentTime);
+		}
+		fflush(stdout);
+		/* the last byte of the answer is the exit status */
+		c = ret;
+		write(STDOUT_FILENO, &c, 1);
+		writestats();
+		dup2(null, STDIN_FILENO);
+		dup2(null, STDOUT_FILENO);
+	}
+}
+
+/* The options other than the prompt, cache and sockets, one after the other
+ * with their NULs. A server takes only clients that have the same. */
+void
+sessionopts(int argc, char *argv[]) {
+	unsigned int i, n;
+
+	for(i = 1; i < argc; i++) {
+		if(!strcmp(argv[i], "-p") || !strcmp(argv[i], "-cf")
+		|| !strcmp(argv[i], "-sv") || !strcmp(argv[i], "-sc")) {
+			i++;
+			continue;
+		}
+		if((n = strlen(argv[i]) + 1) > sizeof opts - optslen) {
+			/* too many to compare, a client shows its own menu */
+			if(serversocket)
+				eprint("dmenu: options too long\n");
+			clientsocket = NULL;
+			return;
+		}
+		memcpy(opts + optslen, argv[i], n);
+		optslen += n;
+	}
 }
 
 void
 setup(void) {
+	double t = stamp();
 	int i, j, sy, slines;
 #if XINERAMA
 	int n;
@@ -1012,36 +1652,32 @@ setup(void) {
 	text[0] = 0;
 	tokens = malloc((xmms?maxtokens:1)*sizeof(char*));
 	match(text);
-	XMapRaised(dpy, win);
 	/* set WM_CLASS */
     XClassHint *ch = XAllocClassHint();
     ch->res_name = "dmenu";
     ch->res_class = "DockApp";
     XSetClassHint(dpy, win, ch);
     XFree(ch);
+	measured(StatSetup, t);
+}
+
+/* the time in microseconds with -stats, else 0 */
+double
+stamp(void) {
+	return statsfile ? clockus() : 0;
 }
 
 int
 textnw(const char *text, unsigned int len) {
-#ifdef XFT
-	if (dc.font.xftfont) {
-		XftTextExtentsUtf8(dpy, dc.font.xftfont, (unsigned const char *) text, strlen(text), dc.font.extents);
-		if(dc.font.extents->height > dc.font.height)
-			dc.font.height = dc.font.extents->height;
-		return dc.font.extents->xOff;
-	}
-	else {
-#endif
-	XRectangle r;
+	unsigned int k, n, cp;
+	int w = 0;
 
-	if(dc.font.set) {
-		XmbTextExtents(dc.font.set, text, len, NULL, &r);
-		return r.width;
+	/* sum of the cached glyph widths */
+	for(k = 0; k < len && text[k]; k += n) {
+		n = nextchar(text + k, len - k, &cp);
+		w += charw(text + k, n, cp);
 	}
-	return XTextWidth(dc.font.xfont, text, len);
-#ifdef XFT
-	}
-#endif
+	return w;
 }
 
 int
@@ -1049,16 +1685,52 @@ textw(const char *text) {
 	return textnw(text, strlen(text)) + dc.font.height;
 }
 
+/* Writes "name count total p50 p99 max" in microseconds for each stat, then
+ * the number of items and result sets, the arena chunks allocated and their
+ * size, and the peak memory use. Everything but the peak starts over for
+ * the next client of -sv. */
+void
+writestats(void) {
+	struct rusage ru;
+	unsigned int j, k, n;
+	double total, *v;
+	FILE *f;
+
+	if(!statsfile || !(f = strcmp(statsfile, "-") ? fopen(statsfile, "w") : stderr))
+		return;
+	fprintf(f, "# name count total_us p50_us p99_us max_us\n");
+	for(k = 0; k < StatLast; k++) {
+		v = stats[k].us;
+		n = stats[k].n;
+		qsort(v, n, sizeof(double), doublecmp);
+		for(j = 0, total = 0; j < n; j++)
+			total += v[j];
+		fprintf(f, "%s %u %.1f %.1f %.1f %.1f\n", stats[k].name, n, total,
+		        n ? v[n / 2] : 0, n ? v[n * 99 / 100] : 0, n ? v[n - 1] : 0);
+	}
+	fprintf(f, "items %u\nresults %u\n", nitems, nresults);
+	fprintf(f, "chunks %u\nchunks_kb %lu\n", nchunks, (unsigned long)(chunkbytes / 1024));
+	if(getrusage(RUSAGE_SELF, &ru) == 0)
+		fprintf(f, "maxrss_kb %ld\n", ru.ru_maxrss);
+	if(f != stderr)
+		fclose(f);
+	for(k = 0; k < StatLast; k++)
+		stats[k].n = 0;
+	nchunks = 0;
+	chunkbytes = 0;
+}
+
 int
 main(int argc, char *argv[]) {
 	unsigned int i;
+	int status;
+	double t;
 
+	initsearch();
 	/* command line args */
 	for(i = 1; i < argc; i++)
-		if(!strcmp(argv[i], "-i")) {
-			fstrncmp = strncasecmp;
-			fstrstr = cistrstr;
-		}
+		if(!strcmp(argv[i], "-i"))
+			foldcase = True;
 		else if(!strcmp(argv[i], "-b"))
 			topbar = False;
 		else if(!strcmp(argv[i], "-r"))
@@ -1095,6 +1767,28 @@ main(int argc, char *argv[]) {
 		else if(!strcmp(argv[i], "-hist")) {
 			if(++i < argc) histfile = argv[i];
         }
+		else if(!strcmp(argv[i], "-cf")) {
+			if(++i < argc) cachefile = argv[i];
+		}
+		else if(!strcmp(argv[i], "-sv")) {
+			if(++i < argc) serversocket = argv[i];
+		}
+		else if(!strcmp(argv[i], "-sc")) {
+			if(++i < argc) clientsocket = argv[i];
+		}
+		else if(!strcmp(argv[i], "-stats")) {
+			if(++i < argc) statsfile = argv[i];
+		}
+		else if(!strcmp(argv[i], "-rec")) {
+			if(++i < argc && !(rec = fopen(argv[i], "w")))
+				eprint("dmenu: cannot write '%s'\n", argv[i]);
+		}
+		else if(!strcmp(argv[i], "-play")) {
+			if(++i < argc && !(play = fopen(argv[i], "r")))
+				eprint("dmenu: cannot read '%s'\n", argv[i]);
+		}
+		else if(!strcmp(argv[i], "-ff"))
+			fastplay = True;
 		else if(!strcmp(argv[i], "-lb")) {
 			if(++i < argc) lastbgcolor = argv[i];
 		}
@@ -1128,13 +1822,29 @@ main(int argc, char *argv[]) {
 			indicators = False;
 		else if(!strcmp(argv[i], "-xs"))
 			xmms = True;
+		else if(!strcmp(argv[i], "-st"))
+			streaming = True;
+		else if(!strcmp(argv[i], "-fz"))
+			fuzzy = True;
+		else if(!strcmp(argv[i], "-ix"))
+			initindex();
+		else if(!strcmp(argv[i], "-j")) {
+			if(++i < argc) matchthreads = MAX(atoi(argv[i]), 1);
+		}
 		else if(!strcmp(argv[i], "-v"))
 			eprint("dmenu-"VERSION", (c) 2006-2008 dmenu engineers, see LICENSE for details\n");
 		else
 			eprint("usage: dmenu [-i] [-b] [-r] [-x <xoffset>] [-y <yoffset>] [-w <width>]\n"
 			       "[-fn <font>] [-nb <color>] [-nf <color>] [-p <prompt>] [-sb <color>]\n"
 			       "[-sf <color>] [-l <#items>] [-h <height>] [-bg <height>] [-c] [-ms]\n"
-			       "[-ml] [-lb <color>] [-lf <color>] [-rs] [-ni] [-nl] [-xs] [-hist <filename>] [-v]\n");
+			       "[-ml] [-lb <color>] [-lf <color>] [-rs] [-ni] [-nl] [-xs] [-fz] [-st] [-ix]\n"
+			       "[-j <threads>] [-hist <filename>] [-cf <cache>] [-sv <socket>]\n"
+			       "[-sc <socket>] [-stats <file>] [-rec <trace>] [-play <trace>] [-ff] [-v]\n");
+
+	/* a running server is asked instead, without touching the display */
+	sessionopts(argc, argv);
+	if(clientsocket && (status = ask(clientsocket)) != -1)
+		return status;
 
 	if(!setlocale(LC_CTYPE, "") || !XSupportsLocale())
 		fprintf(stderr, "warning: no locale support\n");
@@ -1143,19 +1853,29 @@ main(int argc, char *argv[]) {
 	screen = DefaultScreen(dpy);
 	root = RootWindow(dpy, screen);
 
+	if(serversocket) {
+		if(cachefile || !isatty(STDIN_FILENO))
+			readinput();
+		setup();
+		serve(serversocket);
+	}
 	if(isatty(STDIN_FILENO)) {
-		readstdin();
+		readinput();
 		running = grabkeyboard();
 	}
 	else { /* prevent keypress loss */
 		running = grabkeyboard();
-		readstdin();
+		readinput();
 	}
 	
 	setup();
+	t = stamp();
 	drawmenu();
+	drawn(t);
+	XMapRaised(dpy, win);
 	XSync(dpy, False);
 	run();
+	writestats();
 	cleanup();
 	XCloseDisplay(dpy);
 	return ret;
@@ -0,0 +1,386 @@
+/* See LICENSE file for copyright and license details. */
+#include <dirent.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#ifdef __linux__
+#include <sys/syscall.h>
+#endif
+#include "cache.h"
+
+/* macros */
+#define MAXTHREADS 8		/* directories read at once */
+
+/* typedefs */
+typedef struct {
+	char *path;
+	struct timespec mtime;
+	char *chars;		/* NUL terminated names of its executables */
+	size_t nchars, charsize;
+	unsigned int n;
+	int scan;		/* changed since the cache was written */
+} Dir;
+
+#ifdef __linux__
+struct linux_dirent64 {
+	uint64_t d_ino;
+	int64_t d_off;
+	unsigned short d_reclen;
+	unsigned char d_type;
+	char d_name[];
+};
+#endif
+
+/* forward declarations */
+static void addname(Dir *d, const char *name);
+static void eprint(const char *errstr, ...);
+static int isexec(int fd, const char *name, unsigned char type);
+static void loadcache(void);
+static int namecmp(const void *a, const void *b);
+static int printcache(void);
+static void readdirs(void);
+static void scan(Dir *d);
+static void *scanloop(void *arg);
+static void writecache(void);
+
+/* variables */
+static Dir *dirs = NULL;
+static unsigned int ndirs = 0, nextdir = 0;
+static pthread_mutex_t dirmutex = PTHREAD_MUTEX_INITIALIZER;
+static char **names = NULL;	/* unique names, sorted on writing */
+static unsigned int nnames = 0;
+static char cache[4096];
+static char *old = NULL;	/* mapping of the previous cache */
+static size_t oldsize = 0;
+
+void
+addname(Dir *d, const char *name) {
+	size_t len = strlen(name) + 1;
+
+	if(d->nchars + len > d->charsize) {
+		while(d->nchars + len > d->charsize)
+			d->charsize = d->charsize ? 2 * d->charsize : 4096;
+		if(!(d->chars = realloc(d->chars, d->charsize)))
+			eprint("fatal: could not realloc() %u bytes\n", d->charsize);
+	}
+	memcpy(d->chars + d->nchars, name, len);
+	d->nchars += len;
+	d->n++;
+}
+
+void
+eprint(const char *errstr, ...) {
+	va_list ap;
+
+	va_start(ap, errstr);
+	vfprintf(stderr, errstr, ap);
+	va_end(ap);
+	exit(EXIT_FAILURE);
+}
+
+int
+isexec(int fd, const char *name, unsigned char type) {
+	struct stat st;
+
+	if(name[0] == '.')
+		return 0;
+	/* only links and file systems without d_type need a stat */
+	if(type != DT_REG && ((type != DT_LNK && type != DT_UNKNOWN)
+	|| fstatat(fd, name, &st, 0) == -1 || !S_ISREG(st.st_mode)))
+		return 0;
+	return !faccessat(fd, name, X_OK, 0);
+}
+
+/* takes the names of directories that did not change from the last cache */
+void
+loadcache(void) {
+	CacheHeader *h;
+	CacheDir *cd;
+	struct stat st;
+	uint32_t *off, *ent;
+	char *blob, *paths;
+	unsigned int i, j, k;
+	uint64_t pos;
+	int fd;
+
+	if((fd = open(cache, O_RDONLY)) == -1)
+		return;
+	if(fstat(fd, &st) == -1 || st.st_size < (off_t)sizeof(CacheHeader)
+	|| (old = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0)) == MAP_FAILED) {
+		old = NULL;
+		close(fd);
+		return;
+	}
+	close(fd);
+	oldsize = st.st_size;
+	h = (CacheHeader *)old;
+	if(h->magic != CACHEMAGIC || !(h->flags & CACHEFOLDED))
+		return;
+	/* bounds of every section, an old text cache fails the magic check */
+	off = (uint32_t *)(h + 1);
+	blob = (char *)(off + h->n);
+	pos = CACHEALIGN(sizeof *h + (uint64_t)h->n * sizeof *off + 2ULL * h->size);
+	cd = (CacheDir *)(old + pos);
+	pos += (uint64_t)h->ndirs * sizeof *cd;
+	ent = (uint32_t *)(old + pos);
+	pos += (uint64_t)h->nentries * sizeof *ent;
+	paths = old + pos;
+	if(pos + h->pathsize > oldsize || (h->pathsize && paths[h->pathsize - 1])
+	|| (h->size && blob[h->size - 1]))
+		return;
+	for(j = 0; j < h->ndirs; j++) {
+		if(cd[j].path >= h->pathsize || cd[j].first > h->nentries || cd[j].n > h->nentries - cd[j].first)
+			return;
+		for(k = 0; k < ndirs; k++)
+			if(dirs[k].scan && !strcmp(dirs[k].path, paths + cd[j].path)
+			&& dirs[k].mtime.tv_sec == cd[j].sec && dirs[k].mtime.tv_nsec == cd[j].nsec)
+				break;
+		if(k == ndirs)
+			continue;
+		dirs[k].scan = 0;
+		for(i = cd[j].first; i < cd[j].first + cd[j].n; i++)
+			if(ent[i] < h->size)
+				addname(&dirs[k], blob + ent[i]);
+	}
+}
+
+int
+namecmp(const void *a, const void *b) {
+	return strcmp(*(char **)a, *(char **)b);
+}
+
+/* prints the items, as the shell script did */
+int
+printcache(void) {
+	CacheHeader *h;
+	struct stat st;
+	uint32_t *off;
+	char *p;
+	int fd;
+	unsigned int k;
+
+	if((fd = open(cache, O_RDONLY)) == -1)
+		return 0;
+	if(fstat(fd, &st) == -1 || st.st_size < (off_t)sizeof(CacheHeader)
+	|| (p = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0)) == MAP_FAILED) {
+		close(fd);
+		return 0;
+	}
+	close(fd);
+	h = (CacheHeader *)p;
+	off = (uint32_t *)(h + 1);
+	/* a cache cut short by an interrupted run ends inside the blob */
+	if(h->magic != CACHEMAGIC
+	|| st.st_size < (off_t)(sizeof(CacheHeader) + (uint64_t)h->n * sizeof(uint32_t) + h->size)
+	|| (h->size && ((char *)(off + h->n))[h->size - 1])) {
+		munmap(p, st.st_size);
+		return 0;
+	}
+	p = (char *)(off + h->n);
+	for(k = 0; k < h->n; k++)
+		if(off[k] < h->size)
+			puts(p + off[k]);
+	munmap(h, st.st_size);
+	return 1;
+}
+
+/* reads the changed directories on up to MAXTHREADS threads */
+void
+readdirs(void) {
+	pthread_t threads[MAXTHREADS];
+	unsigned int k, n;
+
+	for(k = n = 0; k < ndirs; k++)
+		n += dirs[k].scan;
+	n = n < MAXTHREADS ? n : MAXTHREADS;
+	for(k = 1; k < n; k++)
+		if(pthread_create(&threads[k], NULL, scanloop, NULL))
+			eprint("fatal: could not create thread\n");
+	scanloop(NULL);
+	for(k = 1; k < n; k++)
+		pthread_join(threads[k], NULL);
+}
+
+void
+scan(Dir *d) {
+	int fd;
+#ifdef __linux__
+	char buf[32768];
+	struct linux_dirent64 *e;
+	long n, k;
+
+	if((fd = open(d->path, O_RDONLY | O_DIRECTORY)) == -1)
+		return;
+	/* getdents64 fills the buffer with many entries per call */
+	while((n = syscall(SYS_getdents64, fd, buf, sizeof buf)) > 0)
+		for(k = 0; k < n; k += e->d_reclen) {
+			e = (struct linux_dirent64 *)(buf + k);
+			if(isexec(fd, e->d_name, e->d_type))
+				addname(d, e->d_name);
+		}
+	close(fd);
+#else
+	struct dirent *e;
+	DIR *dp;
+
+	if(!(dp = opendir(d->path)))
+		return;
+	fd = dirfd(dp);
+	while((e = readdir(dp)))
+		if(isexec(fd, e->d_name, DT_UNKNOWN))
+			addname(d, e->d_name);
+	closedir(dp);
+#endif
+}
+
+void *
+scanloop(void *arg) {
+	unsigned int k;
+
+	for(;;) {
+		pthread_mutex_lock(&dirmutex);
+		while(nextdir < ndirs && !dirs[nextdir].scan)
+			nextdir++;
+		k = nextdir++;
+		pthread_mutex_unlock(&dirmutex);
+		if(k >= ndirs)
+			return NULL;
+		scan(&dirs[k]);
+	}
+}
+
+void
+writecache(void) {
+	CacheHeader h = { CACHEMAGIC, CACHEFOLDED, 0, 0, 0, 0, 0, 0 };
+	CacheDir cd;
+	char tmp[sizeof cache + 16], *blob, *p, **slot, **table;
+	uint32_t *off, *ent;
+	unsigned int j, k, tsize, hash, total;
+	uint64_t pos;
+	size_t len;
+	FILE *f;
+
+	/* unique names through a hash set, the first directory in PATH wins */
+	for(k = total = 0; k < ndirs; k++)
+		total += dirs[k].n;
+	for(tsize = 64; tsize < 2 * total; tsize *= 2);
+	if(!(table = calloc(tsize, sizeof(char *))) || !(names = malloc((total + 1) * sizeof(char *)))
+	|| !(ent = malloc((total + 1) * sizeof(uint32_t))))
+		eprint("fatal: could not malloc() %u bytes\n", tsize * sizeof(char *));
+	for(k = 0; k < ndirs; k++)
+		for(j = 0, p = dirs[k].chars; j < dirs[k].n; j++, p += strlen(p) + 1) {
+			for(hash = 2166136261U, len = 0; p[len]; len++)
+				hash = (hash ^ (unsigned char)p[len]) * 16777619U;
+			for(slot = &table[hash & (tsize - 1)]; *slot && strcmp(*slot, p);)
+				slot = slot + 1 < table + tsize ? slot + 1 : table;
+			if(!*slot)
+				names[nnames++] = *slot = p;
+		}
+	qsort(names, nnames, sizeof(char *), namecmp);
+	if(!(off = malloc((nnames + 1) * sizeof(uint32_t))))
+		eprint("fatal: could not malloc() %u bytes\n", (nnames + 1) * sizeof(uint32_t));
+	for(k = 0; k < nnames; k++) {
+		off[h.n++] = h.size;
+		h.size += strlen(names[k]) + 1;
+	}
+	if(!(blob = malloc(h.size + 1)))
+		eprint("fatal: could not malloc() %u bytes\n", h.size + 1);
+	for(k = 0; k < nnames; k++)
+		memcpy(blob + off[k], names[k], strlen(names[k]) + 1);
+	/* each directory's names as offsets into the blob */
+	for(k = 0; k < ndirs; k++) {
+		h.pathsize += strlen(dirs[k].path) + 1;
+		for(j = 0, p = dirs[k].chars; j < dirs[k].n; j++, p += strlen(p) + 1) {
+			slot = bsearch(&p, names, nnames, sizeof(char *), namecmp);
+			ent[h.nentries++] = off[slot - names];
+		}
+	}
+	h.ndirs = ndirs;
+
+	snprintf(tmp, sizeof tmp, "%s.%d", cache, (int)getpid());
+	if(!(f = fopen(tmp, "w")))
+		eprint("dmenu_path: cannot write '%s'\n", tmp);
+	fwrite(&h, sizeof h, 1, f);
+	fwrite(off, sizeof(uint32_t), h.n, f);
+	fwrite(blob, 1, h.size, f);
+	for(len = 0; len < h.size; len++)
+		if(blob[len] >= 'A' && blob[len] <= 'Z')
+			blob[len] |= 0x20;
+	fwrite(blob, 1, h.size, f);
+	pos = sizeof h + (uint64_t)h.n * sizeof(uint32_t) + 2ULL * h.size;
+	fwrite("\0\0\0\0\0\0\0", 1, CACHEALIGN(pos) - pos, f);
+	for(k = 0, j = 0, pos = 0; k < ndirs; k++) {
+		cd.sec = dirs[k].mtime.tv_sec;
+		cd.nsec = dirs[k].mtime.tv_nsec;
+		cd.path = pos;
+		cd.first = j;
+		cd.n = dirs[k].n;
+		cd.pad = 0;
+		fwrite(&cd, sizeof cd, 1, f);
+		pos += strlen(dirs[k].path) + 1;
+		j += dirs[k].n;
+	}
+	fwrite(ent, sizeof(uint32_t), h.nentries, f);
+	for(k = 0; k < ndirs; k++)
+		fwrite(dirs[k].path, 1, strlen(dirs[k].path) + 1, f);
+	if(fclose(f) == EOF || rename(tmp, cache) == -1) {
+		unlink(tmp);
+		eprint("dmenu_path: cannot write '%s'\n", cache);
+	}
+	free(table);
+	free(off);
+	free(ent);
+	free(blob);
+}
+
+int
+main(int argc, char *argv[]) {
+	const char *home = getenv("HOME");
+	struct stat st;
+	char *path, *dir, *p;
+	int i, update = 0;
+	unsigned int k;
+
+	for(i = 1; i < argc; i++)
+		if(!strcmp(argv[i], "-u"))
+			update = 1;
+		else if(!strcmp(argv[i], "-f")) {
+			if(++i < argc) snprintf(cache, sizeof cache, "%s", argv[i]);
+		}
+		else
+			eprint("usage: dmenu_path [-u] [-f <cache>]\n");
+	if(!*cache)
+		snprintf(cache, sizeof cache, "%s/.dmenu_cache", home ? home : ".");
+	if(!(p = path = strdup(getenv("PATH") ? getenv("PATH") : "")))
+		eprint("fatal: could not malloc() %u bytes\n", strlen(getenv("PATH")) + 1);
+	while((dir = strsep(&p, ":"))) {
+		for(k = 0; k < ndirs && strcmp(dirs[k].path, dir); k++);
+		if(!*dir || k < ndirs || stat(dir, &st) == -1 || !S_ISDIR(st.st_mode))
+			continue;
+		if(!(dirs = realloc(dirs, (ndirs + 1) * sizeof(Dir))))
+			eprint("fatal: could not realloc() %u bytes\n", (ndirs + 1) * sizeof(Dir));
+		memset(&dirs[ndirs], 0, sizeof(Dir));
+		dirs[ndirs].path = dir;
+		dirs[ndirs].mtime = st.st_mtim;
+		dirs[ndirs++].scan = 1;
+	}
+	loadcache();
+	for(k = 0; k < ndirs && !dirs[k].scan; k++);
+	/* rewritten when a directory changed or PATH is not what it was */
+	if(k < ndirs || !old || ((CacheHeader *)old)->ndirs != ndirs) {
+		readdirs();
+		writecache();
+	}
+	if(old)
+		munmap(old, oldsize);
+	if(!update && !printcache())
+		eprint("dmenu_path: cannot read '%s'\n", cache);
+	return 0;
+}
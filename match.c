@@ -0,0 +1,1233 @@
+/* See LICENSE file for copyright and license details. */
+#include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "cache.h"
+#include "match.h"
+#include "search.h"
+
+/* macros */
+#define MIN(a, b)               ((a) < (b) ? (a) : (b))
+#define MAX(a, b)               ((a) > (b) ? (a) : (b))
+#define LENGTH(X)               (sizeof X / sizeof X[0])
+#define HISTMAX 4096		/* history entries kept on compaction */
+#define CHUNKSIZE (256 * 1024)	/* bytes per arena chunk */
+#define MINPARALLEL 16384	/* candidates worth waking the match workers for */
+#define SHADOW(c)               ((c)->data + (c)->size)	/* folded copy of an input block */
+#define TRIGRAMS                (1 << 16)
+#define TRIGRAM(a, b, c)        ((((a) << 16 | (b) << 8 | (c)) * 2654435761U) >> 16)
+#define RANKKEY(score, id)      ((unsigned long long)(0x7fffffff - (score)) << 32 | (id))
+#define SCOREMATCH 16		/* fuzzy scoring, see fuzzyscore() */
+#define SCOREGAPSTART 3
+#define SCOREGAPEXTEND 1
+#define BONUSPATH 9
+#define BONUSBOUNDARY 8
+#define BONUSCAMEL 7
+#define BONUSCONSECUTIVE 4
+
+/* typedefs */
+typedef struct Chunk Chunk;
+struct Chunk {
+	Chunk *next;		/* previously filled chunk */
+	size_t size, used;
+	char data[];
+};
+
+typedef struct {
+	char *text;		/* NULL in free slots */
+	unsigned int count;	/* times it was chosen */
+	time_t last;
+	int item;		/* id of the item with its text, -1 if none */
+} Hist;
+
+typedef struct {
+	unsigned int *ids;	/* items containing the trigram, ascending */
+	unsigned int n, size;
+} Posting;
+
+typedef struct {
+	pthread_t thread;
+	unsigned int *cand;	/* slice of the candidates, NULL for all items */
+	unsigned int start, n;	/* position of the slice among all candidates */
+	unsigned int count[4];	/* hits per bucket in the slice */
+	unsigned int pos[4];	/* where the slice's hits go in the result */
+	unsigned int gen;	/* last job taken */
+} Worker;
+
+/* forward declarations */
+static void additem(char *text, char *folded, size_t len);
+static void *arenaalloc(Chunk **arena, size_t size);
+static void classify(Worker *w);
+static void compacthistory(void);
+static Hist *findhist(const char *text, size_t len, Bool add);
+static void freearena(Chunk **arena);
+static unsigned int frecency(Hist *h);
+static int fuzzyitem(unsigned int i, unsigned int tokencnt, unsigned int *plen);
+static int fuzzyscore(const char *s, const char *text, const char *pat, unsigned int len);
+static int histcmp(const void *a, const void *b);
+static Hist *histslot(const char *text, size_t len);
+static void indexitem(unsigned int i);
+static unsigned int intersect(unsigned int *ids, unsigned int n, Posting *p);
+static int itemcmp(const void *a, const void *b);
+static int keycmp(const void *a, const void *b);
+static unsigned int *lookuptrigrams(unsigned int tokencnt, unsigned int *plen, unsigned int *n);
+static Bool mapcache(const char *file);
+static Bool mapstdin(void);
+static int matchitem(unsigned int i, unsigned int tokencnt, unsigned int *plen);
+static Chunk *newchunk(Chunk **arena, size_t size);
+static char *opencache(const char *file, struct stat *st);
+static void orderbucket(unsigned int *v, unsigned int n);
+static void place(Worker *w);
+static int postingcmp(const void *a, const void *b);
+static off_t replayhistory(int fd, off_t from);
+static void runworkers(unsigned int nw, void (*fn)(Worker *w));
+static char *savetext(const char *s, size_t len, Bool fold);
+static void selectkeys(unsigned long long *v, unsigned int n, unsigned int k);
+static unsigned int settokens(char *pattern, unsigned int *plen);
+static void startworkers(unsigned int nw);
+static void stopworkers(void);
+static unsigned int tokenize(char *pat, char **tok);
+static void *workerloop(void *arg);
+
+/* variables */
+char *maxname = NULL;
+char **tokens = NULL;
+Bool xmms = False;
+Bool foldcase = False;
+Bool streaming = False;
+Bool fuzzy = False;
+Items items;
+Result *results = NULL;
+unsigned int nresults = 0;
+unsigned int nitems = 0;
+char *histfile = NULL;
+char *cachefile = NULL;
+struct stat cachestat;
+unsigned int nchunks = 0;
+size_t chunkbytes = 0;
+static Chunk *textarena = NULL;	/* item text */
+static Chunk *input = NULL;	/* stdin blocks items point into */
+static size_t linestart = 0;	/* unfinished line in current input block */
+static char *mapped = NULL;	/* stdin mapping items point into */
+static char *mappedfolded = NULL;
+static size_t mappedsize = 0;
+static char *checked = NULL;	/* cache mapped by checkcache() */
+static struct stat checkedstat;
+static Posting *trigrams = NULL;	/* trigram index, -ix */
+static Worker *workers = NULL;	/* workers[0] is the main thread */
+static unsigned int nworkers = 0;
+static pthread_mutex_t poolmutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t poolwork = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t pooldone = PTHREAD_COND_INITIALIZER;
+static struct {
+	void (*fn)(Worker *w);	/* NULL makes the workers quit */
+	unsigned int gen, nw, busy;
+	unsigned int tokencnt, *plen;
+	unsigned char *cat;	/* bucket of each candidate */
+	int *scores;		/* fuzzy score of each candidate */
+	unsigned int *items;	/* result being filled */
+	unsigned long long *keys;
+} job;
+static Hist *hists = NULL;	/* history by text, open addressing */
+static unsigned int nhists = 0, histsize = 0;
+static unsigned int histrecords = 0;	/* lines in histfile */
+static unsigned int nboosted = 0;	/* items with a frecency */
+static time_t now;
+
+void
+additem(char *text, char *folded, size_t len) {
+	static size_t max = 0;
+	Hist *h;
+
+	if(nitems == items.size) {
+		items.size = items.size ? 2 * items.size : 4096;
+		if(!(items.text = realloc(items.text, items.size * sizeof(char *)))
+		|| !(items.folded = realloc(items.folded, items.size * sizeof(char *)))
+		|| !(items.w = realloc(items.w, items.size * sizeof(int)))
+		|| !(items.frecency = realloc(items.frecency, items.size * sizeof(unsigned int))))
+			eprint("fatal: could not realloc() %u bytes\n", items.size * sizeof(char *));
+	}
+	items.text[nitems] = text;
+	if(!(items.folded[nitems] = folded))
+		items.folded[nitems] = foldcase ? savetext(text, len, True) : text;
+	if(!maxname || max < len) {
+		maxname = text;
+		max = len;
+	}
+	items.w[nitems] = 0;
+	items.frecency[nitems] = 0;
+	if(nhists && (h = findhist(text, len, False))) {
+		items.frecency[nitems] = frecency(h);
+		h->item = nitems;
+		nboosted++;
+	}
+	if(trigrams)
+		indexitem(nitems);
+	nitems++;
+}
+
+void *
+arenaalloc(Chunk **arena, size_t size) {
+	Chunk *c = *arena;
+
+	if(!c || c->size - c->used < size)
+		c = newchunk(arena, size > CHUNKSIZE ? size : CHUNKSIZE);
+	c->used += size;
+	return c->data + c->used - size;
+}
+
+void
+classify(Worker *w) {
+	unsigned int k;
+	unsigned char *cat = job.cat + w->start;
+	unsigned int i;
+
+	memset(w->count, 0, sizeof w->count);
+	for(k = 0; k < w->n; k++) {
+		i = w->cand ? w->cand[k] : w->start + k;
+		if(job.scores)
+			cat[k] = (job.scores[w->start + k] = fuzzyitem(i, job.tokencnt, job.plen)) > 0;
+		else
+			cat[k] = matchitem(i, job.tokencnt, job.plen);
+		w->count[cat[k]]++;
+	}
+}
+
+/* Maps the cache at file for the next readstdin() and tells whether it is a
+ * whole one; the items there are until then are left alone. */
+Bool
+checkcache(const char *file) {
+	if(checked)
+		munmap(checked, checkedstat.st_size);
+	return (checked = opencache(file, &checkedstat)) != NULL;
+}
+
+void
+cleanupmatch(void) {
+	unsigned int k;
+
+	freeitems();
+	if(checked)
+		munmap(checked, checkedstat.st_size);
+	for(k = 0; trigrams && k < TRIGRAMS; k++)
+		free(trigrams[k].ids);
+	free(trigrams);
+	free(items.text);
+	free(items.folded);
+	free(items.w);
+	free(items.frecency);
+	free(results);
+	stopworkers();
+}
+
+/* rewrites the log with one record for each of the HISTMAX most frecent entries */
+void
+compacthistory(void) {
+	char tmp[4096];
+	Hist **v;
+	unsigned int j, k;
+	Bool synced;
+	FILE *f;
+
+	if(!(v = malloc((nhists + 1) * sizeof(Hist *))))
+		eprint("fatal: could not malloc() %u bytes\n", (nhists + 1) * sizeof(Hist *));
+	for(j = k = 0; k < histsize; k++)
+		if(hists[k].text)
+			v[j++] = &hists[k];
+	qsort(v, j, sizeof(Hist *), histcmp);
+	j = MIN(j, HISTMAX);
+	snprintf(tmp, sizeof tmp, "%s.%d", histfile, (int)getpid());
+	if((f = fopen(tmp, "w"))) {
+		for(k = 0; k < j; k++)
+			fprintf(f, "%ld\t%u\t%s\n", (long)v[k]->last, v[k]->count, v[k]->text);
+		/* a crash leaves either the old log or the whole new one */
+		synced = fflush(f) != EOF && fsync(fileno(f)) != -1;
+		if(fclose(f) == EOF || !synced || rename(tmp, histfile) == -1)
+			unlink(tmp);
+		else
+			histrecords = j;
+	}
+	free(v);
+}
+
+void
+eprint(const char *errstr, ...) {
+	va_list ap;
+
+	va_start(ap, errstr);
+	vfprintf(stderr, errstr, ap);
+	va_end(ap);
+	exit(EXIT_FAILURE);
+}
+
+/* Matches the items against pattern, narrowing down the result of the
+ * pattern it extends; returns the result with its best matches in order. */
+Result *
+filter(char *pattern) {
+	unsigned int k, n, w, nw, ncand, tokencnt, plen[maxtokens], count[4];
+	unsigned int *cand, *ixcand = NULL;
+	Result *r;
+
+	/* forget result sets of patterns the new one does not extend */
+	while(nresults && strncmp(results[nresults - 1].pattern, pattern,
+	                          strlen(results[nresults - 1].pattern)))
+		popresult();
+
+	if(!nresults || strcmp(results[nresults - 1].pattern, pattern)) {
+		tokencnt = settokens(pattern, plen);
+
+		/* a longer pattern can only narrow down the previous result */
+		if(nresults) {
+			cand = results[nresults - 1].items;
+			ncand = results[nresults - 1].n;
+		}
+		else {
+			cand = NULL;
+			ncand = nitems;
+		}
+		/* the trigram index may know fewer candidates */
+		if(trigrams && !fuzzy && (ixcand = lookuptrigrams(tokencnt, plen, &k))) {
+			if(k < ncand) {
+				cand = ixcand;
+				ncand = k;
+			}
+			else {
+				free(ixcand);
+				ixcand = NULL;
+			}
+		}
+		if(!(job.cat = malloc(ncand + 1)))
+			eprint("fatal: could not malloc() %u bytes\n", ncand + 1);
+		if(fuzzy && !(job.scores = malloc((ncand + 1) * sizeof(int))))
+			eprint("fatal: could not malloc() %u bytes\n", (ncand + 1) * sizeof(int));
+		job.tokencnt = tokencnt;
+		job.plen = plen;
+		/* split the candidates into one slice per worker */
+		nw = matchthreads > 1 && ncand >= MINPARALLEL ? matchthreads : 1;
+		startworkers(nw);
+		for(w = 0; w < nw; w++) {
+			workers[w].start = (unsigned long long)ncand * w / nw;
+			workers[w].n = (unsigned long long)ncand * (w + 1) / nw - workers[w].start;
+			workers[w].cand = cand ? cand + workers[w].start : NULL;
+		}
+		runworkers(nw, classify);
+
+		if(!(results = realloc(results, (nresults + 1) * sizeof(Result))))
+			eprint("fatal: could not realloc() %u bytes\n", (nresults + 1) * sizeof(Result));
+		r = &results[nresults++];
+		memset(count, 0, sizeof count);
+		for(w = 0; w < nw; w++)
+			for(k = 1; k <= 3; k++)
+				count[k] += workers[w].count[k];
+		r->n = count[1] + count[2] + count[3];
+		r->nexact = count[1];
+		r->nprefix = count[2];
+		if(!(r->pattern = strdup(pattern))
+		|| !(r->items = malloc((r->n + 1) * sizeof(unsigned int))))
+			eprint("fatal: could not malloc() %u bytes\n", (r->n + 1) * sizeof(unsigned int));
+		r->keys = NULL;
+		r->nranked = 0;
+		r->pages = NULL;
+		r->npages = r->pagesize = 0;
+		r->paged = False;
+		if(fuzzy && !(r->keys = malloc((r->n + 1) * sizeof(unsigned long long))))
+			eprint("fatal: could not malloc() %u bytes\n", (r->n + 1) * sizeof(unsigned long long));
+		/* concatenate the slices' buckets in input order */
+		for(w = 0; w < nw; w++)
+			for(k = 1; k <= 3; k++)
+				workers[w].pos[k] = w ? workers[w - 1].pos[k] + workers[w - 1].count[k]
+				                      : (k > 1 ? count[1] : 0) + (k > 2 ? count[2] : 0);
+		job.items = r->items;
+		job.keys = r->keys;
+		runworkers(nw, place);
+		free(job.cat);
+		free(job.scores);
+		job.scores = NULL;
+		free(ixcand);
+
+		/* items may change buckets while narrowing, restore their order */
+		for(k = 1, n = 0; (cand || nboosted) && !fuzzy && k <= 3; n += count[k++])
+			orderbucket(r->items + n, count[k]);
+	}
+
+	r = &results[nresults - 1];
+	/* only the best fuzzy matches are put in order up front */
+	rank(r, RANKCHUNK);
+	return r;
+}
+
+/* Matches the items from first on against every result set; returns False
+ * if there were none. */
+Bool
+filtertail(unsigned int first) {
+	unsigned int i, j, k, n, from, ntail, tokencnt, plen[maxtokens], count[4], pos[4], boosted[4];
+	unsigned char *cat;
+	unsigned long long *keys;
+	int *scores = NULL;
+	unsigned int *v;
+	Result *r;
+
+	ntail = nitems - first;
+	if(!ntail || !(cat = malloc(ntail)))
+		return False;
+	if(fuzzy && !(scores = malloc(ntail * sizeof(int))))
+		eprint("fatal: could not malloc() %u bytes\n", ntail * sizeof(int));
+	/* new items come last in input order, append them to every bucket */
+	for(j = 0; j < nresults; j++) {
+		r = &results[j];
+		tokencnt = settokens(r->pattern, plen);
+		memset(count, 0, sizeof count);
+		memset(boosted, 0, sizeof boosted);
+		for(k = 0, i = first; k < ntail; i++, k++)
+			if(r->keys)
+				count[cat[k] = (scores[k] = fuzzyitem(i, tokencnt, plen)) > 0]++;
+			else
+				count[cat[k] = matchitem(i, tokencnt, plen)]++;
+		if(!(n = count[1] + count[2] + count[3]))
+			continue;
+		if(!(v = realloc(r->items, (r->n + n + 1) * sizeof(unsigned int))))
+			eprint("fatal: could not realloc() %u bytes\n", (r->n + n + 1) * sizeof(unsigned int));
+		r->items = v;
+		r->npages = 0;
+		r->paged = False;
+		if(r->keys) {
+			if(!(keys = realloc(r->keys, (r->n + n + 1) * sizeof(unsigned long long))))
+				eprint("fatal: could not realloc() %u bytes\n", (r->n + n + 1) * sizeof(unsigned long long));
+			r->keys = keys;
+			/* new fuzzy matches join the unranked rest, unless they beat the ranked ones */
+			for(k = 0, i = first; k < ntail; i++, k++)
+				if(cat[k]) {
+					keys[r->n] = RANKKEY(scores[k], i);
+					if(r->nranked && keys[r->n] < keys[r->nranked - 1])
+						r->nranked = 0;
+					v[r->n++] = i;
+				}
+			r->nexact = r->n;
+			if(j == nresults - 1 && !r->nranked)
+				rank(r, RANKCHUNK);
+			continue;
+		}
+		memmove(v + r->nexact + r->nprefix + count[1] + count[2], v + r->nexact + r->nprefix,
+		        (r->n - r->nexact - r->nprefix) * sizeof(unsigned int));
+		memmove(v + r->nexact + count[1], v + r->nexact, r->nprefix * sizeof(unsigned int));
+		pos[1] = r->nexact;
+		pos[2] = r->nexact + count[1] + r->nprefix;
+		pos[3] = r->n + n - count[3];
+		for(k = 0, i = first; k < ntail; i++, k++)
+			if(cat[k]) {
+				boosted[cat[k]] += items.frecency[i] != 0;
+				v[pos[cat[k]]++] = i;
+			}
+		r->nexact += count[1];
+		r->nprefix += count[2];
+		r->n += n;
+		/* new history items move up in their bucket */
+		for(k = 1, from = 0; k <= 3; from = pos[k++])
+			if(boosted[k])
+				orderbucket(v + from, pos[k] - from);
+	}
+	free(cat);
+	free(scores);
+	return True;
+}
+
+Hist *
+findhist(const char *text, size_t len, Bool add) {
+	Hist *h, *old = hists;
+	unsigned int k, oldsize = histsize;
+
+	if(add && 2 * (nhists + 1) > histsize) {
+		histsize = histsize ? 2 * histsize : 256;
+		if(!(hists = calloc(histsize, sizeof(Hist))))
+			eprint("fatal: could not malloc() %u bytes\n", histsize * sizeof(Hist));
+		for(k = 0; k < oldsize; k++)
+			if(old[k].text)
+				*histslot(old[k].text, strlen(old[k].text)) = old[k];
+		free(old);
+	}
+	if(!histsize)
+		return NULL;
+	if((h = histslot(text, len))->text || !add)
+		return h->text ? h : NULL;
+	if(!(h->text = malloc(len + 1)))
+		eprint("fatal: could not malloc() %u bytes\n", len + 1);
+	memcpy(h->text, text, len);
+	h->text[len] = 0;
+	h->item = -1;
+	nhists++;
+	return h;
+}
+
+/* times chosen, weighted by how recently */
+unsigned int
+frecency(Hist *h) {
+	time_t age = now - h->last;
+
+	return h->count * (age < 3600 ? 8 : age < 86400 ? 4 : age < 604800 ? 2 : 1);
+}
+
+void
+freearena(Chunk **arena) {
+	Chunk *c;
+
+	while((c = *arena)) {
+		*arena = c->next;
+		free(c);
+	}
+}
+
+/* forgets the items, their history and what was matched against them */
+void
+freeitems(void) {
+	unsigned int k;
+
+	while(nresults)
+		popresult();
+	freearena(&textarena);
+	freearena(&input);
+	if(mapped)
+		munmap(mapped, mappedsize);
+	free(mappedfolded);
+	mapped = mappedfolded = NULL;
+	linestart = 0;
+	for(k = 0; trigrams && k < TRIGRAMS; k++)
+		trigrams[k].n = 0;
+	maxname = NULL;
+	nitems = nboosted = 0;
+	for(k = 0; k < histsize; k++)
+		free(hists[k].text);
+	free(hists);
+	hists = NULL;
+	nhists = histsize = histrecords = 0;
+}
+
+int
+fuzzyitem(unsigned int i, unsigned int tokencnt, unsigned int *plen) {
+	unsigned int j;
+	int score, total = 0;
+
+	for(j = 0; j < tokencnt; j++) {
+		if(!(score = fuzzyscore(items.folded[i], items.text[i], tokens[j], plen[j])))
+			return 0;
+		total += score;
+	}
+	return total;
+}
+
+/* Scores the shortest occurrence of pat as a subsequence of s, fzf style:
+ * matches on word boundaries, path components and camelCase humps earn a
+ * bonus which a run of consecutive matches carries on, gaps cost. text is
+ * s before case folding. Returns 0 if pat does not occur. */
+int
+fuzzyscore(const char *s, const char *text, const char *pat, unsigned int len) {
+	int i, b, e, score = 0, bonus, runbonus = 0, gap = 0;
+	unsigned int k;
+	unsigned char p, c;
+
+	if(!len)
+		return 1;
+	/* the first occurrence ends at e, it starts at b at the latest */
+	for(e = 0, k = 0; s[e]; e++)
+		if(s[e] == pat[k] && ++k == len)
+			break;
+	if(k < len)
+		return 0;
+	for(b = e, k = len; b >= 0; b--)
+		if(s[b] == pat[k - 1] && !--k)
+			break;
+	for(i = b, k = 0; k < len; i++) {
+		if(s[i] != pat[k]) {
+			score -= gap ? SCOREGAPEXTEND : SCOREGAPSTART;
+			gap = 1;
+			continue;
+		}
+		c = text[i];
+		p = i ? text[i - 1] : '/';
+		if(p == '/')
+			bonus = BONUSPATH;
+		else if(strchr(" -_.:", p))
+			bonus = BONUSBOUNDARY;
+		else if((islower(p) && isupper(c)) || (!isdigit(p) && isdigit(c)))
+			bonus = BONUSCAMEL;
+		else
+			bonus = 0;
+		/* a run keeps the bonus of its first character */
+		if(k && !gap)
+			bonus = MAX(bonus, MAX(runbonus, BONUSCONSECUTIVE));
+		else
+			runbonus = bonus;
+		score += SCOREMATCH + (k ? bonus : 2 * bonus);
+		gap = 0;
+		k++;
+	}
+	return MAX(score, 0) + 1;
+}
+
+/* makes room for need elements in the array p of *size */
+void *
+grow(void *p, unsigned int *size, unsigned int need, size_t elem) {
+	if(need <= *size)
+		return p;
+	while(*size < need)
+		*size = *size ? 2 * *size : 64;
+	if(!(p = realloc(p, *size * elem)))
+		eprint("fatal: could not realloc() %u bytes\n", *size * elem);
+	return p;
+}
+
+int
+histcmp(const void *a, const void *b) {
+	unsigned int fa = frecency(*(Hist **)a), fb = frecency(*(Hist **)b);
+
+	return fa > fb ? -1 : fa < fb;
+}
+
+/* adds the entries the input did not have, like commands typed before */
+void
+histitems(void) {
+	unsigned int k;
+
+	for(k = 0; k < histsize; k++)
+		if(hists[k].text && hists[k].item < 0)
+			additem(hists[k].text, NULL, strlen(hists[k].text));
+}
+
+/* the slot of the len bytes of text, or the free one they would take */
+Hist *
+histslot(const char *text, size_t len) {
+	unsigned int hash, k;
+	size_t j;
+
+	for(hash = 2166136261U, j = 0; j < len; j++)
+		hash = (hash ^ (unsigned char)text[j]) * 16777619U;
+	for(k = hash & (histsize - 1); hists[k].text; k = (k + 1) & (histsize - 1))
+		if(!strncmp(hists[k].text, text, len) && !hists[k].text[len])
+			break;
+	return &hists[k];
+}
+
+void
+indexitem(unsigned int i) {
+	const unsigned char *s = (const unsigned char *)items.folded[i];
+	Posting *p;
+
+	for(; s[0] && s[1] && s[2]; s++) {
+		p = &trigrams[TRIGRAM(s[0], s[1], s[2])];
+		if(p->n && p->ids[p->n - 1] == i)
+			continue;
+		if(p->n == p->size
+		&& !(p->ids = realloc(p->ids, (p->size = p->size ? 2 * p->size : 4) * sizeof(unsigned int))))
+			eprint("fatal: could not realloc() %u bytes\n", p->size * sizeof(unsigned int));
+		p->ids[p->n++] = i;
+	}
+}
+
+/* indexes the items added from now on by their trigrams, -ix */
+void
+initindex(void) {
+	if(!trigrams && !(trigrams = calloc(TRIGRAMS, sizeof(Posting))))
+		eprint("fatal: could not malloc() %u bytes\n", TRIGRAMS * sizeof(Posting));
+}
+
+unsigned int
+intersect(unsigned int *ids, unsigned int n, Posting *p) {
+	unsigned int i, j = 0, k = 0, lo, hi, mid, step;
+
+	for(i = 0; i < n && j < p->n; i++) {
+		/* gallop to the first posting not below ids[i] */
+		for(step = 1; j + step < p->n && p->ids[j + step] < ids[i]; step *= 2)
+			j += step;
+		for(lo = j, hi = MIN(j + step, p->n); lo < hi;) {
+			mid = lo + (hi - lo) / 2;
+			if(p->ids[mid] < ids[i])
+				lo = mid + 1;
+			else
+				hi = mid;
+		}
+		if((j = lo) < p->n && p->ids[j] == ids[i])
+			ids[k++] = ids[i];
+	}
+	return k;
+}
+
+int
+itemcmp(const void *a, const void *b) {
+	unsigned int ia = *(unsigned int *)a, ib = *(unsigned int *)b;
+
+	if(items.frecency[ia] != items.frecency[ib])
+		return items.frecency[ia] > items.frecency[ib] ? -1 : 1;
+	return ia < ib ? -1 : ia > ib;
+}
+
+int
+keycmp(const void *a, const void *b) {
+	unsigned long long ka = *(unsigned long long *)a, kb = *(unsigned long long *)b;
+
+	return ka < kb ? -1 : ka > kb;
+}
+
+unsigned int *
+lookuptrigrams(unsigned int tokencnt, unsigned int *plen, unsigned int *n) {
+	unsigned int j, k, nlists = 0, *ids;
+	Posting *lists[PATTERNSIZE];
+	const unsigned char *t;
+
+	for(j = 0; j < tokencnt; j++)
+		for(k = 0, t = (const unsigned char *)tokens[j]; k + 2 < plen[j] && nlists < LENGTH(lists); k++)
+			lists[nlists++] = &trigrams[TRIGRAM(t[k], t[k + 1], t[k + 2])];
+	if(!nlists)
+		return NULL;
+	/* start from the rarest trigram, every item has to contain them all */
+	qsort(lists, nlists, sizeof(Posting *), postingcmp);
+	if(!(ids = malloc((lists[0]->n + 1) * sizeof(unsigned int))))
+		eprint("fatal: could not malloc() %u bytes\n", (lists[0]->n + 1) * sizeof(unsigned int));
+	/* an empty posting list has no ids to copy */
+	if((*n = lists[0]->n))
+		memcpy(ids, lists[0]->ids, *n * sizeof(unsigned int));
+	for(k = 1; *n && k < nlists; k++)
+		if(lists[k] != lists[k - 1])
+			*n = intersect(ids, *n, lists[k]);
+	return ids;
+}
+
+Bool
+mapcache(const char *file) {
+	CacheHeader *h;
+	struct stat st;
+	uint32_t *off;
+	char *blob, *folded, *m;
+	unsigned int k;
+
+	/* checkcache() may have mapped it already */
+	if((m = checked)) {
+		st = checkedstat;
+		checked = NULL;
+	}
+	else if(!(m = opencache(file, &st)))
+		return False;
+	mapped = m;
+	mappedsize = st.st_size;
+	cachestat = st;
+	h = (CacheHeader *)mapped;
+	off = (uint32_t *)(h + 1);
+	blob = (char *)(off + h->n);
+	folded = foldcase && h->flags & CACHEFOLDED ? blob + h->size : NULL;
+	/* items point into the mapping, nothing is copied */
+	for(k = 0; k < h->n; k++)
+		if(off[k] < h->size)
+			additem(blob + off[k], folded ? folded + off[k] : NULL, strlen(blob + off[k]));
+	return True;
+}
+
+Bool
+mapstdin(void) {
+	struct stat st;
+	char *p, *end, *nl;
+
+	if(fstat(STDIN_FILENO, &st) == -1 || !S_ISREG(st.st_mode) || st.st_size <= 0)
+		return False;
+	mappedsize = st.st_size;
+	/* private writable mapping, newlines are replaced in place */
+	if((mapped = mmap(NULL, mappedsize, PROT_READ | PROT_WRITE, MAP_PRIVATE,
+	                  STDIN_FILENO, 0)) == MAP_FAILED) {
+		mapped = NULL;
+		return False;
+	}
+	if(foldcase) {
+		if(!(mappedfolded = malloc(mappedsize)))
+			eprint("fatal: could not malloc() %u bytes\n", mappedsize);
+		foldcopy(mappedfolded, mapped, mappedsize);
+	}
+	for(p = mapped, end = mapped + mappedsize; p < end; p = nl + 1) {
+		if(!(nl = memchr(p, '\n', end - p))) {
+			/* no room to terminate the last line inside the mapping */
+			additem(savetext(p, end - p, False), NULL, end - p);
+			break;
+		}
+		*nl = 0;
+		if(mappedfolded)
+			mappedfolded[nl - mapped] = 0;
+		additem(p, mappedfolded ? mappedfolded + (p - mapped) : NULL, nl - p);
+	}
+	return True;
+}
+
+int
+matchitem(unsigned int i, unsigned int tokencnt, unsigned int *plen) {
+	const char *s = items.folded[i];
+	unsigned int j;
+	int append = 0;
+
+	for(j = 0; j < tokencnt; ++j) {
+		if(!strncmp(tokens[j], s, plen[j] + 1))
+			append = 1;
+		else if(!strncmp(tokens[j], s, plen[j]))
+			append = !append || append > 2 ? 2 : append;
+		else if(strstr(s, tokens[j]))
+			append = append ? append : 3;
+		else
+			return 0;
+	}
+	return append;
+}
+
+Chunk *
+newchunk(Chunk **arena, size_t size) {
+	Chunk *c;
+
+	if(!(c = malloc(sizeof(Chunk) + size)))
+		eprint("fatal: could not malloc() %u bytes\n", sizeof(Chunk) + size);
+	nchunks++;
+	chunkbytes += sizeof(Chunk) + size;
+	c->next = *arena;
+	c->size = size;
+	c->used = 0;
+	return *arena = c;
+}
+
+/* Maps the cache at file if it is a whole one: every section within the
+ * file and the blobs ending in a NUL. */
+char *
+opencache(const char *file, struct stat *st) {
+	CacheHeader *h;
+	uint32_t *off;
+	char *m, *blob;
+	int fd;
+
+	if((fd = open(file, O_RDONLY)) == -1)
+		return NULL;
+	if(fstat(fd, st) == -1 || st->st_size < (off_t)sizeof(CacheHeader)
+	|| (m = mmap(NULL, st->st_size, PROT_READ, MAP_PRIVATE, fd, 0)) == MAP_FAILED) {
+		close(fd);
+		return NULL;
+	}
+	close(fd);
+	h = (CacheHeader *)m;
+	off = (uint32_t *)(h + 1);
+	if(h->magic != CACHEMAGIC
+	|| sizeof *h + (uint64_t)h->n * sizeof *off
+	   + (h->flags & CACHEFOLDED ? 2ULL : 1ULL) * h->size > (uint64_t)st->st_size) {
+		munmap(m, st->st_size);
+		return NULL;
+	}
+	blob = (char *)(off + h->n);
+	if(h->size && (blob[h->size - 1] || (h->flags & CACHEFOLDED && blob[2 * h->size - 1]))) {
+		munmap(m, st->st_size);
+		return NULL;
+	}
+	return m;
+}
+
+/* history items by frecency first, then the rest in input order */
+void
+orderbucket(unsigned int *v, unsigned int n) {
+	static unsigned int *rest = NULL;
+	static unsigned int restsize = 0;
+	unsigned int j, nb, nr;
+
+	for(j = nb = 0; nboosted && j < n; j++)
+		nb += items.frecency[v[j]] != 0;
+	if(nb) {
+		rest = grow(rest, &restsize, n - nb, sizeof(unsigned int));
+		for(j = nb = nr = 0; j < n; j++)
+			if(items.frecency[v[j]])
+				v[nb++] = v[j];
+			else
+				rest[nr++] = v[j];
+		memcpy(v + nb, rest, nr * sizeof(unsigned int));
+		qsort(v, nb, sizeof(unsigned int), itemcmp);
+	}
+	for(j = nb + 1; j < n; j++)
+		if(v[j - 1] > v[j]) {
+			qsort(v + nb, n - nb, sizeof(unsigned int), itemcmp);
+			break;
+		}
+}
+
+void
+place(Worker *w) {
+	unsigned int k;
+	unsigned char *cat = job.cat + w->start;
+	unsigned int i;
+
+	for(k = 0; k < w->n; k++) {
+		i = w->cand ? w->cand[k] : w->start + k;
+		if(!cat[k])
+			continue;
+		if(job.keys)
+			job.keys[w->pos[cat[k]]] = RANKKEY(job.scores[w->start + k], i);
+		job.items[w->pos[cat[k]]++] = i;
+	}
+}
+
+void
+popresult(void) {
+	Result *r = &results[--nresults];
+
+	free(r->pattern);
+	free(r->items);
+	free(r->keys);
+	free(r->pages);
+}
+
+int
+postingcmp(const void *a, const void *b) {
+	unsigned int na = (*(Posting **)a)->n, nb = (*(Posting **)b)->n;
+
+	return na < nb ? -1 : na > nb;
+}
+
+void
+rank(Result *r, unsigned int upto) {
+	unsigned int k;
+
+	if(!r->keys || r->nranked >= r->n || upto <= r->nranked)
+		return;
+	/* grow geometrically, so paging to the end stays O(n log n) */
+	upto = MIN(MAX(upto, 2 * r->nranked), r->n);
+	selectkeys(r->keys + r->nranked, r->n - r->nranked, upto - r->nranked);
+	qsort(r->keys + r->nranked, upto - r->nranked, sizeof(unsigned long long), keycmp);
+	for(k = r->nranked; k < r->n; k++)
+		r->items[k] = r->keys[k] & 0xffffffff;
+	r->nranked = upto;
+}
+
+Bool
+readblock(void) {
+	Chunk *c = input, *full;
+	char *p, *nl;
+	size_t len, size;
+	ssize_t n;
+
+	if(!c || c->used == c->size) {
+		/* carry the unfinished line over to the start of a fresh block */
+		len = c ? c->used - linestart : 0;
+		size = 2 * len > CHUNKSIZE ? 2 * len : CHUNKSIZE;
+		/* with -i the second half holds the folded copy */
+		c = newchunk(&input, foldcase ? 2 * size : size);
+		c->size = size;
+		if(len) {
+			full = c->next;
+			memcpy(c->data, full->data + linestart, len);
+			if(foldcase)
+				memcpy(SHADOW(c), SHADOW(full) + linestart, len);
+			c->used = len;
+			if(!linestart) { /* no item points into a single partial line */
+				c->next = full->next;
+				free(full);
+			}
+		}
+		linestart = 0;
+	}
+	if((n = read(STDIN_FILENO, c->data + c->used, c->size - c->used)) < 0 && errno == EINTR)
+		return True;
+	if(n <= 0) {
+		/* blocks always keep room to terminate the last line */
+		if((len = c->used - linestart)) {
+			c->data[c->used] = 0;
+			if(foldcase)
+				SHADOW(c)[c->used] = 0;
+			additem(c->data + linestart, foldcase ? SHADOW(c) + linestart : NULL, len);
+			linestart = ++c->used;
+		}
+		return False;
+	}
+	if(foldcase)
+		foldcopy(SHADOW(c) + c->used, c->data + c->used, n);
+	for(p = c->data + c->used; (nl = memchr(p, '\n', c->data + c->used + n - p)); p = nl + 1) {
+		*nl = 0;
+		if(foldcase)
+			SHADOW(c)[nl - c->data] = 0;
+		additem(c->data + linestart, foldcase ? SHADOW(c) + linestart : NULL,
+		        nl - (c->data + linestart));
+		linestart = nl + 1 - c->data;
+	}
+	c->used += n;
+	return True;
+}
+
+void
+readhistory(void) {
+	off_t done;
+	struct stat st, path;
+	int fd;
+
+	now = time(NULL);
+	if(!histfile || (fd = open(histfile, O_RDONLY)) == -1)
+		return;
+	flock(fd, LOCK_SH);
+	done = replayhistory(fd, 0);
+	if(histrecords > 2 * nhists + 64 || nhists > HISTMAX) {
+		/* take what was appended while waiting, unless another
+		 * instance compacted the log first */
+		if(flock(fd, LOCK_EX) == 0 && fstat(fd, &st) == 0 && stat(histfile, &path) == 0
+		&& st.st_ino == path.st_ino && st.st_dev == path.st_dev) {
+			replayhistory(fd, done);
+			compacthistory();
+		}
+	}
+	close(fd);
+}
+
+/* reads the items from the cache or stdin, after readhistory() */
+void
+readstdin(void) {
+	if(cachefile) {
+		if(!mapcache(cachefile))
+			eprint("dmenu: cannot read cache '%s'\n", cachefile);
+		streaming = False;
+	}
+	else if(mapstdin())
+		streaming = False;
+	else if(!(streaming = streaming && !isatty(STDIN_FILENO)))
+		while(readblock());
+	if(!streaming)
+		histitems();
+}
+
+/* adds the entries the input did not have and rates all of them as of now */
+void
+refreshhistory(void) {
+	unsigned int k;
+
+	now = time(NULL);
+	histitems();
+	for(k = 0; k < histsize; k++)
+		if(hists[k].item >= 0)
+			items.frecency[hists[k].item] = frecency(&hists[k]);
+}
+
+/* Adds up the records of fd after from, up to the last complete one; returns
+ * where they end. A record is "<last used>\t<count>\t<text>\n", a line of
+ * the old format counts as chosen once. */
+off_t
+replayhistory(int fd, off_t from) {
+	struct stat st;
+	char *map, *line, *end, *p;
+	unsigned long count;
+	long last;
+	Hist *h;
+
+	if(fstat(fd, &st) == -1 || st.st_size <= from
+	|| (map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0)) == MAP_FAILED)
+		return from;
+	/* a crash may have cut the last record short */
+	for(line = map + from; (end = memchr(line, '\n', map + st.st_size - line)); line = end + 1) {
+		histrecords++;
+		for(last = 0, p = line; p < end && *p >= '0' && *p <= '9'; p++)
+			last = 10 * last + *p - '0';
+		for(count = 0, p += p > line && *p == '\t'; p < end && *p >= '0' && *p <= '9'; p++)
+			count = 10 * count + *p - '0';
+		if(count && p < end && *p == '\t')
+			p++;
+		else {
+			p = line;
+			count = 1;
+			last = 0;
+		}
+		if(p == end)
+			continue;
+		h = findhist(p, end - p, True);
+		h->count += count;
+		h->last = MAX(h->last, last);
+	}
+	munmap(map, st.st_size);
+	return line - map;
+}
+
+void
+runworkers(unsigned int nw, void (*fn)(Worker *w)) {
+	if(nw == 1) {
+		fn(&workers[0]);
+		return;
+	}
+	pthread_mutex_lock(&poolmutex);
+	job.fn = fn;
+	job.nw = nw;
+	job.busy = nw - 1;
+	job.gen++;
+	pthread_cond_broadcast(&poolwork);
+	pthread_mutex_unlock(&poolmutex);
+	fn(&workers[0]);
+	pthread_mutex_lock(&poolmutex);
+	while(job.busy)
+		pthread_cond_wait(&pooldone, &poolmutex);
+	pthread_mutex_unlock(&poolmutex);
+}
+
+char *
+savetext(const char *s, size_t len, Bool fold) {
+	char *p = arenaalloc(&textarena, len + 1);
+
+	if(fold)
+		foldcopy(p, s, len);
+	else
+		memcpy(p, s, len);
+	p[len] = 0;
+	return p;
+}
+
+/* moves the k smallest keys to the front of v, in no particular order */
+void
+selectkeys(unsigned long long *v, unsigned int n, unsigned int k) {
+	long lo = 0, hi = n, i, j;
+	unsigned long long pivot, t;
+
+	while(hi - lo > 1 && (long)k > lo && (long)k < hi) {
+		pivot = v[lo + (hi - lo) / 2];
+		for(i = lo, j = hi - 1; i <= j;) {
+			while(v[i] < pivot)
+				i++;
+			while(v[j] > pivot)
+				j--;
+			if(i <= j) {
+				t = v[i];
+				v[i++] = v[j];
+				v[j--] = t;
+			}
+		}
+		/* v[lo..j] <= pivot <= v[i..hi-1] */
+		if((long)k <= j)
+			hi = j + 1;
+		else if((long)k >= i)
+			lo = i;
+		else
+			break;
+	}
+}
+
+unsigned int
+settokens(char *pattern, unsigned int *plen) {
+	static char folded[PATTERNSIZE];
+	unsigned int k, tokencnt;
+
+	if(foldcase) {
+		strncpy(folded, pattern, sizeof folded - 1);
+		foldcopy(folded, folded, strlen(folded));
+		pattern = folded;
+	}
+	if(!xmms)
+		tokens[(tokencnt = 1)-1] = pattern;
+	else
+		if(!(tokencnt = tokenize(pattern, tokens)))
+			tokens[(tokencnt = 1)-1] = "";
+	for(k = 0; k < tokencnt; k++)
+		plen[k] = strlen(tokens[k]);
+	return tokencnt;
+}
+
+void
+startworkers(unsigned int nw) {
+	if(!workers && !(workers = calloc(matchthreads, sizeof(Worker))))
+		eprint("fatal: could not malloc() %u bytes\n", matchthreads * sizeof(Worker));
+	for(; nworkers < nw; nworkers++) {
+		workers[nworkers].gen = job.gen;
+		if(nworkers && pthread_create(&workers[nworkers].thread, NULL, workerloop, &workers[nworkers]))
+			eprint("fatal: could not create match thread\n");
+	}
+}
+
+void
+stopworkers(void) {
+	pthread_mutex_lock(&poolmutex);
+	job.fn = NULL;
+	job.gen++;
+	pthread_cond_broadcast(&poolwork);
+	pthread_mutex_unlock(&poolmutex);
+	while(nworkers > 1)
+		pthread_join(workers[--nworkers].thread, NULL);
+	free(workers);
+	workers = NULL;
+	nworkers = 0;
+}
+
+unsigned int tokenize(char *pat, char **tok)
+{
+	unsigned int i = 0;
+	static char tmp[PATTERNSIZE];
+
+	strncpy(tmp, pat, sizeof tmp - 1);
+	tok[0] = strtok(tmp, " ");
+
+	while(tok[i] && ++i < maxtokens)
+		tok[i] = strtok(NULL, " ");
+	return i;
+}
+
+void *
+workerloop(void *arg) {
+	Worker *w = arg;
+
+	pthread_mutex_lock(&poolmutex);
+	for(;;) {
+		while(w->gen == job.gen)
+			pthread_cond_wait(&poolwork, &poolmutex);
+		w->gen = job.gen;
+		if(!job.fn)
+			break;
+		if(w - workers >= job.nw)
+			continue;
+		pthread_mutex_unlock(&poolmutex);
+		job.fn(w);
+		pthread_mutex_lock(&poolmutex);
+		if(!--job.busy)
+			pthread_cond_signal(&pooldone);
+	}
+	pthread_mutex_unlock(&poolmutex);
+	return NULL;
+}
+
+/* Appends a record of the choice of text, or item i, to the log with one
+ * write, which other instances see complete or not at all. */
+void
+writehistory(const char *text, int i) {
+	struct stat st, path;
+	char *rec, c = '\n';
+	size_t size;
+	int fd, len;
+	Hist *h;
+
+	if(!histfile || !*text)
+		return;
+	h = findhist(text, strlen(text), True);
+	h->count++;
+	h->last = time(NULL);
+	if(i >= 0 && h->item < 0) {
+		h->item = i;
+		nboosted++;
+	}
+	/* the log may be replaced by a compaction while waiting for the lock */
+	for(;;) {
+		if((fd = open(histfile, O_RDWR | O_APPEND | O_CREAT, 0666)) == -1)
+			return;
+		if(flock(fd, LOCK_EX) == -1 || fstat(fd, &st) == -1) {
+			close(fd);
+			return;
+		}
+		if(stat(histfile, &path) == 0 && st.st_ino == path.st_ino && st.st_dev == path.st_dev)
+			break;
+		close(fd);
+	}
+	/* end a record a crash cut short, so that this one stays whole */
+	if(st.st_size && pread(fd, &c, 1, st.st_size - 1) != 1)
+		c = '\n';
+	size = strlen(text) + 32;
+	if(!(rec = malloc(size)))
+		eprint("fatal: could not malloc() %u bytes\n", size);
+	len = snprintf(rec, size, "%s%ld\t1\t%s\n", c == '\n' ? "" : "\n", (long)h->last, text);
+	if(write(fd, rec, len) == len)
+		histrecords++;
+	free(rec);
+	close(fd);
+}
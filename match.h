@@ -0,0 +1,64 @@
+/* See LICENSE file for copyright and license details. */
+
+/* The items, reading them and matching them against a pattern, apart from
+ * anything X: dmenu draws what these leave in results, bench times them.
+ * Items are numbered in input order, a result lists the ids of its exact,
+ * prefix and substring matches. */
+#ifndef Bool
+#define Bool int
+#define True 1
+#define False 0
+#endif
+#define PATTERNSIZE 4096	/* bytes of a pattern, with the NUL */
+#define RANKCHUNK 256		/* fuzzy matches ranked ahead of the view */
+
+typedef struct {
+	char **text;
+	char **folded;		/* text as matched, lowercase with -i */
+	int *w;			/* width of text as drawn, 0 until measured */
+	unsigned int *frecency;	/* from the history, ranks it in its bucket */
+	unsigned int size;
+} Items; /* the items by id */
+
+typedef struct {
+	char *pattern;		/* pattern the items were matched against */
+	unsigned int *items;	/* ids of the exact, prefix and substring matches in order */
+	unsigned int n;
+	unsigned int nexact, nprefix;
+	unsigned long long *keys;	/* score and id of each item with -fz */
+	unsigned int nranked;	/* items in final order with -fz */
+	unsigned int *pages;	/* first items of the pages of the horizontal menu */
+	unsigned int npages, pagesize;
+	Bool paged;		/* pages holds all of them */
+} Result;
+
+Bool checkcache(const char *file);
+void cleanupmatch(void);
+void eprint(const char *errstr, ...);
+Result *filter(char *pattern);
+Bool filtertail(unsigned int first);
+void freeitems(void);
+void *grow(void *p, unsigned int *size, unsigned int need, size_t elem);
+void histitems(void);
+void initindex(void);
+void popresult(void);
+void rank(Result *r, unsigned int upto);
+Bool readblock(void);
+void readhistory(void);
+void readstdin(void);
+void refreshhistory(void);
+void writehistory(const char *text, int i);
+
+extern char *maxname;		/* longest item */
+extern char **tokens;		/* maxtokens of them with -xs, else one */
+extern Bool xmms, foldcase, streaming, fuzzy;
+extern Items items;
+extern Result *results;		/* result sets of each narrowing step */
+extern unsigned int nresults, nitems;
+extern char *histfile;		/* -hist */
+extern char *cachefile;		/* -cf */
+extern struct stat cachestat;	/* of cachefile when it was mapped */
+extern unsigned int nchunks;	/* arena chunks allocated, for -stats */
+extern size_t chunkbytes;
+/* up to the program, see config.h */
+extern unsigned int maxtokens, matchthreads;
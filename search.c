@@ -0,0 +1,90 @@
+/* See LICENSE file for copyright and license details. */
+#include <stdint.h>
+#include <string.h>
+#if defined(__GNUC__) && (defined(__x86_64__) || (defined(__i386__) && defined(__SSE2__)))
+#define X86SIMD
+#include <immintrin.h>
+#endif
+#include "search.h"
+
+/* macros */
+#define FOLD(c)                 ((c) >= 'A' && (c) <= 'Z' ? (c) | 0x20 : (c))
+
+/* forward declarations */
+static void scalarfoldcopy(char *dst, const char *src, size_t n);
+#ifdef X86SIMD
+static void sse2foldcopy(char *dst, const char *src, size_t n);
+static void avx2foldcopy(char *dst, const char *src, size_t n);
+#endif
+
+/* variables */
+static void (*foldcopyfn)(char *, const char *, size_t) = scalarfoldcopy;
+static const char *impl = "scalar";
+
+void
+foldcopy(char *dst, const char *src, size_t n) {
+	foldcopyfn(dst, src, n);
+}
+
+void
+initsearch(void) {
+#ifdef X86SIMD
+	__builtin_cpu_init();
+	if(__builtin_cpu_supports("avx2")) {
+		foldcopyfn = avx2foldcopy;
+		impl = "avx2";
+	}
+	else if(__builtin_cpu_supports("sse2")) {
+		foldcopyfn = sse2foldcopy;
+		impl = "sse2";
+	}
+#endif
+}
+
+void
+scalarfoldcopy(char *dst, const char *src, size_t n) {
+	unsigned char c;
+
+	for(; n; n--) {
+		c = *src++;
+		*dst++ = FOLD(c);
+	}
+}
+
+const char *
+searchimpl(void) {
+	return impl;
+}
+
+#ifdef X86SIMD
+static inline __attribute__((always_inline)) __m128i
+fold128(__m128i v) {
+	__m128i up = _mm_and_si128(_mm_cmpgt_epi8(v, _mm_set1_epi8('A' - 1)),
+	                           _mm_cmplt_epi8(v, _mm_set1_epi8('Z' + 1)));
+
+	return _mm_or_si128(v, _mm_and_si128(up, _mm_set1_epi8(0x20)));
+}
+
+void
+sse2foldcopy(char *dst, const char *src, size_t n) {
+	for(; n >= 16; dst += 16, src += 16, n -= 16)
+		_mm_storeu_si128((__m128i *)dst, fold128(_mm_loadu_si128((const __m128i *)src)));
+	scalarfoldcopy(dst, src, n);
+}
+
+__attribute__((target("avx2"), always_inline)) static inline __m256i
+fold256(__m256i v) {
+	__m256i up = _mm256_and_si256(_mm256_cmpgt_epi8(v, _mm256_set1_epi8('A' - 1)),
+	                              _mm256_cmpgt_epi8(_mm256_set1_epi8('Z' + 1), v));
+
+	return _mm256_or_si256(v, _mm256_and_si256(up, _mm256_set1_epi8(0x20)));
+}
+
+__attribute__((target("avx2"))) void
+avx2foldcopy(char *dst, const char *src, size_t n) {
+	for(; n >= 32; dst += 32, src += 32, n -= 32)
+		_mm256_storeu_si256((__m256i *)dst, fold256(_mm256_loadu_si256((const __m256i *)src)));
+	_mm256_zeroupper();
+	scalarfoldcopy(dst, src, n);
+}
+#endif
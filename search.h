@@ -0,0 +1,6 @@
+/* See LICENSE file for copyright and license details. */
+
+/* ASCII case folding; SSE2 or AVX2 when the cpu has it */
+void foldcopy(char *dst, const char *src, size_t n);
+void initsearch(void);
+const char *searchimpl(void);